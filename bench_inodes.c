@@ -0,0 +1,150 @@
+/* Benchmark for the index node layout.
+
+   -- NUM_THREADS threads each read their own small file over and over,
+   once with files whose index nodes are adjacent in the inode table and
+   once with files whose index nodes are SPREAD inodes apart, far enough
+   that no layout puts two of them on the same or neighbouring lines.
+   -- The files are created on a fresh ramdisk, and inodes are handed out
+   lowest number first, so /adjN get consecutive inodes and SPREAD - 1
+   filler files sit between each pair of /farN.
+   -- Both runs pay the same for the ioctl, the descriptor table lookup
+   and the buffers, so the adjacent/spread ratio isolates what
+   neighbouring inodes cost each other. With cache-line-aligned inodes it
+   should stay near 1.00; build the module from the commit before the
+   inode layout change to get the packed numbers to compare against.
+   -- Needs at least NUM_THREADS cpus to mean anything.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "ramdisk.h"
+
+#define NUM_THREADS 4
+#define SPREAD 8		/* Inodes between two /farN files */
+#define ITERATIONS 200000
+#define BLK_SZ 256		/* Block size */
+#define READ_SZ 64		/* Bytes read per iteration */
+
+static char pathname[80];
+static char data[BLK_SZ];	/* One block, too big to be stored inline */
+
+static double elapsed_seconds (struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+typedef struct reader_arg {
+  const char *prefix;
+  long id;
+} reader_arg_t;
+
+static void *reader (void *arg) {
+  reader_arg_t *ra = (reader_arg_t *) arg;
+  char name[80], buf[READ_SZ];
+  int fd, i, retval;
+
+  sprintf (name, "/%s%ld", ra->prefix, ra->id);
+  fd = rd_open (name);
+  if (fd < 0) {
+    fprintf (stderr, "rd_open: %s open error! status: %d\n", name, fd);
+    exit (1);
+  }
+
+  for (i = 0; i < ITERATIONS; i++) {
+    retval = rd_pread (fd, buf, READ_SZ, 0);
+    if (retval != READ_SZ) {
+      fprintf (stderr, "rd_pread: %s read error! status: %d\n", name, retval);
+      exit (1);
+    }
+  }
+
+  rd_close (fd);
+  return NULL;
+}
+
+/* Runs num_threads readers of the files named prefix<N> at once and returns the reads per second of one thread */
+static double run_readers (const char *prefix, int num_threads) {
+  pthread_t threads[NUM_THREADS];
+  reader_arg_t args[NUM_THREADS];
+  struct timespec start, end;
+  long i;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < num_threads; i++) {
+    args[i].prefix = prefix;
+    args[i].id = i;
+    pthread_create (&threads[i], NULL, reader, &args[i]);
+  }
+  for (i = 0; i < num_threads; i++)
+    pthread_join (threads[i], NULL);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  return ITERATIONS / elapsed_seconds (&start, &end);
+}
+
+/* Creates pathname, writing one block to it unless it is a filler */
+static void create_file (int filler) {
+  int retval, fd;
+
+  retval = rd_creat (pathname);
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: File creation error! status: %d\n", retval);
+    exit (1);
+  }
+  if (filler)
+    return;
+  fd = rd_open (pathname);
+  retval = rd_write (fd, data, sizeof (data));
+  if (retval != sizeof (data)) {
+    fprintf (stderr, "rd_write: File write error! status: %d\n", retval);
+    exit (1);
+  }
+  rd_close (fd);
+}
+
+int main () {
+  int i, j;
+  double single, adjacent, spread;
+
+  memset (data, 'h', sizeof (data));
+
+  /* Create the files one after the other so that they get adjacent inodes */
+  for (i = 0; i < NUM_THREADS; i++) {
+    sprintf (pathname, "/adj%d", i);
+    create_file (0);
+  }
+  for (i = 0; i < NUM_THREADS; i++) {
+    sprintf (pathname, "/far%d", i);
+    create_file (0);
+    for (j = 1; j < SPREAD; j++) {
+      sprintf (pathname, "/pad%d_%d", i, j);
+      create_file (1);
+    }
+  }
+
+  single = run_readers ("adj", 1);
+  adjacent = run_readers ("adj", NUM_THREADS);
+  spread = run_readers ("far", NUM_THREADS);
+
+  printf ("1 thread:  %.0f reads/s\n", single);
+  printf ("%d threads, adjacent inodes: %.0f reads/s per thread (%.2fx the 1 thread rate)\n",
+	  NUM_THREADS, adjacent, adjacent / single);
+  printf ("%d threads, spread inodes:   %.0f reads/s per thread (%.2fx the 1 thread rate)\n",
+	  NUM_THREADS, spread, spread / single);
+  printf ("adjacent/spread: %.2f\n", adjacent / spread);
+
+  for (i = 0; i < NUM_THREADS; i++) {
+    sprintf (pathname, "/adj%d", i);
+    rd_unlink (pathname);
+    sprintf (pathname, "/far%d", i);
+    rd_unlink (pathname);
+    for (j = 1; j < SPREAD; j++) {
+      sprintf (pathname, "/pad%d_%d", i, j);
+      rd_unlink (pathname);
+    }
+  }
+
+  return 0;
+}
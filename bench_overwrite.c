@@ -0,0 +1,115 @@
+/* Benchmark for small random overwrites of a big file.
+
+   -- Writes a FILE_MB MB file, then overwrites UPDATES records of
+   RECORD_SZ bytes at random record-aligned offsets, seeking to each
+   one with rd_lseek before the rd_write, and reports the update rate.
+   -- An overwrite has to land on the blocks already there: the file
+   must not grow, and free_blocks in /proc/ramdisk_stats must be the
+   same before and after the updates since no block is allocated.
+   -- The ramdisk has to be large enough for the file, e.g.
+   insmod ramdisk_module.ko rd_size=67108864
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ramdisk.h"
+
+#define FILE_MB 16
+#define UPDATES 200000
+#define RECORD_SZ 64		/* Bytes per update */
+#define WRITE_SZ (256 * 1024)	/* Bytes per rd_write call while filling the file */
+#define FILE_SZ ((long long) FILE_MB * 1024 * 1024)
+
+static char buf[WRITE_SZ];
+
+static double elapsed_seconds (struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the free_blocks line of the ramdisk statistics, or -1 if it can't be read */
+static long free_blocks (void) {
+  char line[128];
+  long blocks = -1;
+  FILE *stats = fopen ("/proc/ramdisk_stats", "r");
+
+  if (stats == NULL)
+    return -1;
+  while (fgets (line, sizeof (line), stats) != NULL)
+    if (strncmp (line, "free_blocks ", 12) == 0)
+      blocks = atol (line + 12);
+  fclose (stats);
+  return blocks;
+}
+
+int main () {
+  int retval, fd, i;
+  long long offset = 0;
+  long free_before, free_after;
+  char record[RECORD_SZ];
+  struct timespec start, end;
+  double seconds;
+
+  memset (buf, 'o', sizeof (buf));
+
+  retval = rd_creat ("/overwritefile");
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: File creation error! status: %d\n", retval);
+    exit (1);
+  }
+  fd = rd_open ("/overwritefile");
+  if (fd < 0) {
+    fprintf (stderr, "rd_open: File open error! status: %d\n", fd);
+    exit (1);
+  }
+
+  for (i = 0; i < FILE_SZ / WRITE_SZ; i++) {
+    retval = rd_write (fd, buf, WRITE_SZ);
+    if (retval != WRITE_SZ) {
+      fprintf (stderr, "rd_write: File write error! status: %d (is the ramdisk big enough?)\n", retval);
+      exit (1);
+    }
+  }
+
+  srand (1);
+  free_before = free_blocks ();
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < UPDATES; i++) {
+    offset = (long long) (rand () % (FILE_SZ / RECORD_SZ)) * RECORD_SZ;
+    memset (record, 'a' + i % 26, RECORD_SZ);
+    rd_lseek (fd, offset);
+    retval = rd_write (fd, record, RECORD_SZ);
+    if (retval != RECORD_SZ) {
+      fprintf (stderr, "rd_write: Overwrite error at %lld! status: %d\n", offset, retval);
+      exit (1);
+    }
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  seconds = elapsed_seconds (&start, &end);
+  free_after = free_blocks ();
+
+  /* The last record written has to read back, and nothing may follow the original EOF */
+  retval = rd_pread (fd, buf, RECORD_SZ, offset);
+  if (retval != RECORD_SZ || memcmp (buf, record, RECORD_SZ) != 0) {
+    fprintf (stderr, "rd_pread: Overwritten record at %lld doesn't read back! status: %d\n", offset, retval);
+    exit (1);
+  }
+  retval = rd_pread (fd, buf, RECORD_SZ, FILE_SZ);
+  if (retval != 0) {
+    fprintf (stderr, "rd_pread: File grew past %lld bytes!\n", FILE_SZ);
+    exit (1);
+  }
+  if (free_before != free_after) {
+    fprintf (stderr, "free_blocks went from %ld to %ld during the overwrites!\n", free_before, free_after);
+    exit (1);
+  }
+
+  printf ("%d overwrites of %d bytes in %.3f s: %.0f updates/s, free_blocks unchanged at %ld\n",
+	  UPDATES, RECORD_SZ, seconds, UPDATES / seconds, free_after);
+
+  rd_close (fd);
+  rd_unlink ("/overwritefile");
+
+  return 0;
+}
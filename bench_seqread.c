@@ -0,0 +1,90 @@
+/* Benchmark for sequential reads of a big file.
+
+   -- Writes a FILE_MB MB file and reads it back from start to end
+   PASSES times in READ_SZ reads, reporting the read throughput.
+   -- The ramdisk has to be large enough for the file, e.g.
+   insmod ramdisk_module.ko rd_size=67108864
+   -- Run it once as above and once after reloading the module with
+   rd_vmalloc_metadata=1 to compare metadata in the direct map against
+   vmalloced metadata. Where the metadata ended up is read from
+   /proc/ramdisk_stats.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ramdisk.h"
+
+#define FILE_MB 16
+#define PASSES 20
+#define READ_SZ (256 * 1024)	/* Bytes per rd_read/rd_write call */
+
+static char buf[READ_SZ];
+
+static double elapsed_seconds (struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Prints the metadata_direct_map line of the ramdisk statistics */
+static void print_metadata_mapping (void) {
+  char line[128];
+  FILE *stats = fopen ("/proc/ramdisk_stats", "r");
+
+  if (stats == NULL)
+    return;
+  while (fgets (line, sizeof (line), stats) != NULL)
+    if (strncmp (line, "metadata_direct_map ", 20) == 0)
+      printf ("%s", line);
+  fclose (stats);
+}
+
+int main () {
+  int retval, fd, i, pass;
+  long total = 0;
+  struct timespec start, end;
+  double seconds;
+
+  memset (buf, 's', sizeof (buf));
+
+  retval = rd_creat ("/seqfile");
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: File creation error! status: %d\n", retval);
+    exit (1);
+  }
+  fd = rd_open ("/seqfile");
+  if (fd < 0) {
+    fprintf (stderr, "rd_open: File open error! status: %d\n", fd);
+    exit (1);
+  }
+
+  for (i = 0; i < FILE_MB * 1024 * 1024 / READ_SZ; i++) {
+    retval = rd_write (fd, buf, READ_SZ);
+    if (retval != READ_SZ) {
+      fprintf (stderr, "rd_write: File write error! status: %d (is the ramdisk big enough?)\n", retval);
+      exit (1);
+    }
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (pass = 0; pass < PASSES; pass++) {
+    rd_lseek (fd, 0);
+    while ((retval = rd_read (fd, buf, READ_SZ)) > 0)
+      total += retval;
+    if (retval < 0) {
+      fprintf (stderr, "rd_read: File read error! status: %d\n", retval);
+      exit (1);
+    }
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  seconds = elapsed_seconds (&start, &end);
+
+  print_metadata_mapping ();
+  printf ("read %ld MB in %.3f s: %.1f MB/s\n", total / (1024 * 1024), seconds,
+	  total / (1024.0 * 1024.0) / seconds);
+
+  rd_close (fd);
+  rd_unlink ("/seqfile");
+
+  return 0;
+}
@@ -1,30 +1,73 @@
 #include <linux/list.h>
+#include <linux/cache.h>
 
 //define some constants here
-#define RD_SIZE 0x200000    //2MB
+#define DEFAULT_RD_SIZE 0x200000    //2MB, overridden by the rd_size module parameter
+#define DEFAULT_INDEX_NODES 1024    //overridden by the rd_inodes module parameter
+/*
+ * Block geometry profile. The default 256 byte blocks suit lots of small
+ * files and directories. Building with RD_PAGE_BLOCKS (make RD_PAGE_BLOCKS=1)
+ * selects page sized 4 KB blocks instead, so big files need 16 times fewer
+ * block lookups and copies per page. Blocks never straddle a page, since the
+ * chunks backing them are page aligned.
+ */
+#ifdef RD_PAGE_BLOCKS
+#define BLOCK_SIZE 4096
+#define BLOCK_GROUP_SIZE 16  //blocks summarized by one block group
+#define ZERO_RESERVOIR_TARGET 32    //free blocks the zeroing thread keeps pre-zeroed
+#define ZERO_BATCH 8        //blocks the zeroing thread claims at a time
+#define INDIRECT_LEVELS 3   //single, double and triple indirect trees
+#define EXTENT_MAX_DEPTH 5  //index levels above the leaves, enough for MAX_FILE_BLOCKS even in half full nodes
+#else
 #define BLOCK_SIZE 256
-#define BLOCK_POINTER_SIZE 4
+#define BLOCK_GROUP_SIZE 64  //blocks summarized by one block group
+#define ZERO_RESERVOIR_TARGET 512   //free blocks the zeroing thread keeps pre-zeroed
+#define ZERO_BATCH 64       //blocks the zeroing thread claims at a time
+#define INDIRECT_LEVELS 4   //single, double, triple and quadruple indirect trees
+#define EXTENT_MAX_DEPTH 7  //index levels above the leaves, enough for MAX_FILE_BLOCKS even in half full nodes
+#endif
+#define BLOCK_POINTER_SIZE 4    //sizeof(block_num_t)
 #define DIRECT 8
 #define POINTER_PER_BLOCK (BLOCK_SIZE / BLOCK_POINTER_SIZE)
-#define BLOCK_INDEX_NODES 256
-#define INDEX_NODE_SIZE 64
-#define INDEX_NODES (BLOCK_INDEX_NODES * (BLOCK_SIZE / INDEX_NODE_SIZE))
-#define BLOCK_BITMAPS 4
-#define BLOCK_DATA ((BLOCK_SIZE - BLOCK_SIZE * (1 + BLOCK_INDEX_NODES + BLOCK_BITMAPS)) / BLOCK_SIZE)
-#define DIR_ENTRY_SIZE 16
+#define INLINE_DATA_SIZE 64   //bytes stored in the block map line of an inline inode, two directory entries
+#define EXTENT_SIZE 12     //sizeof(extent_t)
+#define EXTENT_HEADER_SIZE 4    //sizeof(extent_header_t)
+#define ROOT_EXTENTS ((INLINE_DATA_SIZE - EXTENT_HEADER_SIZE) / EXTENT_SIZE)  //extents in the block map line of an inode
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - EXTENT_HEADER_SIZE) / EXTENT_SIZE)
+#define INDEX_NODE_SIZE (2 * SMP_CACHE_BYTES)   //a line of locking state and a line of block map
+#define CHUNK_SIZE (BLOCK_GROUP_SIZE * BLOCK_SIZE)  //bytes of backing memory allocated at a time, one per block group
+#define PAGES_PER_CHUNK ((CHUNK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)  //single pages backing a chunk
+#define NO_BLOCK (~0UL)     //block number meaning none/no placement goal
+#define DIR_ENTRY_SIZE 32  //room for a 14 byte name and a 32-bit inode number
 #define DIR_ENTRY_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_SIZE)
-#define MAX_DIR_ENTRIES (DIR_ENTRY_PER_BLOCK * (DIRECT + POINTER_PER_BLOCK + POINTER_PER_BLOCK*POINTER_PER_BLOCK))
-#define MAX_FILES 1023
-#define MAX_FILE_SIZE (BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK + POINTER_PER_BLOCK*POINTER_PER_BLOCK))
+/*
+ * A file is limited to what the direct pointers and the indirect trees can
+ * map, extent inodes included. The small default blocks need a fourth
+ * level to get there: 17043528 blocks, 4363143168 bytes (4 GB), so one
+ * file can fill most of a multi-GB ramdisk. With RD_PAGE_BLOCKS three
+ * levels already map about 4 TB.
+ */
+#define MAX_FILE_BLOCKS ((loff_t) DIRECT + POINTER_PER_BLOCK + (loff_t) POINTER_PER_BLOCK * POINTER_PER_BLOCK \
+                         + (loff_t) POINTER_PER_BLOCK * POINTER_PER_BLOCK * POINTER_PER_BLOCK \
+                         + (INDIRECT_LEVELS > 3 ? (loff_t) POINTER_PER_BLOCK * POINTER_PER_BLOCK \
+                                                  * POINTER_PER_BLOCK * POINTER_PER_BLOCK : 0))
+#define MAX_DIR_ENTRIES (DIR_ENTRY_PER_BLOCK * MAX_FILE_BLOCKS)
+#define MAX_FILE_SIZE (BLOCK_SIZE * MAX_FILE_BLOCKS)
 #define MAX_FILE_NAME_LEN 14
 #define INIT_FDT_LEN 64     //init file descriptor length
+#define MAGAZINE_SIZE 32    //free block numbers cached per cpu
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)  //blocks moved per refill/drain
 
 
 //define data structures here
 typedef struct rd_super_block {
-    int num_free_blocks;
-    int num_free_inodes;
-    /* Additional info? (struct can be as large as BLK_SZ bytes) */
+    atomic_long_t num_free_blocks;  // blocks free in the bitmap, not counting the per-cpu magazines
+    atomic_long_t num_free_inodes;
+    // layout of the ramdisk, laid out by rd_init from the module parameters
+    unsigned long num_index_nodes;
+    unsigned long index_node_blocks;
+    unsigned long bitmap_blocks;
+    unsigned long data_blocks;
 } super_block_t;
 
 typedef enum FILE_TYPE {
@@ -34,34 +77,162 @@ typedef enum FILE_TYPE {
     REG
 } file_type_t;
 
+// index_node_t.flags
+#define INODE_INLINE 0x1    // the file's bytes are stored in direct and indirect, not in blocks
+#define INODE_EXTENTS 0x2   // direct and indirect hold the root of an extent tree, not block pointers
+
+// index_node_t.home_node of a file whose blocks come from the pool of the writing cpu's node
+#define NO_HOME_NODE (-1)
+
+/*
+ * Block maps refer to data blocks by their number in the data region rather
+ * than by address, so the image doesn't depend on where it is mapped.
+ * Block 0 is never allocated and means "no block".
+ */
+typedef u32 block_num_t;
+
+// a block of numbers of data blocks, or of the indirect blocks of the next level down
 typedef struct indirect_block {
-    void *data[POINTER_PER_BLOCK];
+    block_num_t data[POINTER_PER_BLOCK];
 } indirect_block_t;
 
-typedef struct double_indirect_block_t {
-    indirect_block_t *indirect_blocks[POINTER_PER_BLOCK];
-} double_indirect_block_t;
-
+/*
+ * Every access to a file writes file_lock and usually open_count, so they sit
+ * with size, type and the rest of the file's state on a cache line of their
+ * own. The block map, which readers only read, fills the next line.
+ * Neighbouring inodes never share a line, so threads working on different
+ * files don't bounce each other's lines.
+ */
 typedef struct index_node {
-    file_type_t type;
-    int size;
-    atomic_t open_count;    // Used to allow readers to increment open_count
     rwlock_t file_lock;     // sizeof(rwlock_t) == 4
-    void *direct[DIRECT];
-    indirect_block_t *single_indirect;
-    double_indirect_block_t *double_indirect;
-} index_node_t;             //sizeof(index_node_t) == 52?
+    atomic_t open_count;    // Used to allow readers to increment open_count
+    file_type_t type : 8;
+    unsigned int flags : 8;
+    unsigned int generation;    // bumped whenever a mapped block is unmapped, see block_cursor_t
+    int home_node;          // NUMA node whose pool new blocks come from, inherited from the parent directory
+    loff_t size;
+    union {
+        struct {
+            block_num_t direct[DIRECT];
+            block_num_t indirect[INDIRECT_LEVELS];  // indirect[i] is the root of a tree i + 1 levels deep
+        };
+        char inline_data[INLINE_DATA_SIZE];     // the whole line, past the pointers too
+    } ____cacheline_aligned;
+} ____cacheline_aligned index_node_t;   //sizeof(index_node_t) == INDEX_NODE_SIZE
+
+// the data of an INODE_INLINE inode, which overlays its block pointers
+#define INLINE_DATA(inode) ((inode)->inline_data)
+
+/*
+ * An INODE_EXTENTS inode maps its file as sorted runs of consecutive file
+ * blocks stored in consecutive data blocks. The first ROOT_EXTENTS of them
+ * live in the inode; past that the root holds index entries pointing at
+ * tree blocks of EXTENTS_PER_BLOCK entries each, ext2/4 style. An index
+ * entry's logical block is the lowest file block mapped below it.
+ */
+typedef struct extent {
+    u32 logical;        // first file block
+    block_num_t start;  // first data block, or the tree block below for an index entry
+    u32 length;         // blocks, unused in index entries
+} extent_t;
+
+typedef struct extent_header {
+    u16 count;
+    u16 depth;          // 0 for a leaf
+} extent_header_t;
+
+// a node of the extent tree, the inode's root or a tree block
+typedef struct extent_node {
+    extent_header_t header;
+    extent_t extents[EXTENTS_PER_BLOCK];
+} extent_node_t;
+
+#define EXTENT_ROOT(inode) ((extent_node_t *) (inode)->inline_data)
 
 typedef struct directory_entry {
     char filename[MAX_FILE_NAME_LEN];   // 14 bytes including null terminator
-    unsigned short index_node_number;   // 2 bytes
+    char reserved[DIR_ENTRY_SIZE - MAX_FILE_NAME_LEN - 4];  // pads the entry to DIR_ENTRY_SIZE
+    unsigned int index_node_number;     // 4 bytes, room for millions of inodes
 } directory_entry_t;
 
+/*
+ * The last block a file descriptor resolved, so that sequential I/O finds
+ * the next block in the same indirect block without walking the tree again.
+ * Only valid while generation matches the inode's, since appending blocks
+ * never moves the ones already mapped but unmapping them does.
+ */
+typedef struct block_cursor {
+    unsigned long block_index;  // file block
+    void *block_address;        // NULL if the cursor is empty
+    block_num_t block_num;
+    block_num_t leaf;           // indirect block holding its number, 0 for a direct block or an extent
+    unsigned int slot;          // its slot in leaf or in direct, or the blocks after it in its extent
+    unsigned int generation;
+} block_cursor_t;
+
 typedef struct file_object {
     index_node_t *index_node;
-    off_t file_position;
+    loff_t file_position;
+    block_cursor_t cursor;
 } file_object_t;
 
+/*
+ * Per-cpu cache of block numbers that are already marked used in the
+ * block bitmap and already subtracted from num_free_blocks. lock is only
+ * contended when another cpu steals from this magazine.
+ */
+typedef struct block_magazine {
+    spinlock_t lock;
+    int count;
+    unsigned long blocks[MAGAZINE_SIZE];
+    unsigned long hits;     // allocations served without a refill
+    unsigned long misses;   // allocations that needed a refill or steal
+    unsigned long refills;
+    unsigned long drains;
+    unsigned long steals;
+    unsigned long zeroed_hits;      // allocations that got a pre-zeroed block
+    unsigned long zeroed_misses;    // allocations that had to zero their block
+} block_magazine_t;
+
+/*
+ * Per-cpu NUMA counters, summed up per node of the cpus in
+ * /proc/ramdisk_stats. A block access is remote when the block's pages are
+ * on another node than the cpu copying it.
+ */
+typedef struct node_stats {
+    unsigned long local_accesses;
+    unsigned long remote_accesses;
+    unsigned long remote_allocations;   // blocks allocated out of another node's pool
+} node_stats_t;
+
+/*
+ * A run of contiguous blocks reserved up front for an operation whose size
+ * is known, e.g. an append in rd_write. Blocks are handed out of the run in
+ * ascending order; wanted is what the operation still expects to need once
+ * the current run is used up.
+ */
+typedef struct block_reservation {
+    unsigned long next;
+    unsigned long count;
+    unsigned long wanted;
+} block_reservation_t;
+
+/*
+ * Block tree of an unlinked file, waiting for the reclaim worker. Only the
+ * size and block pointers of mapping are used.
+ */
+typedef struct reclaim_request {
+    struct list_head list;
+    unsigned long num_blocks;   // blocks the size implies, added to pending_reclaim_blocks
+    index_node_t mapping;
+} reclaim_request_t;
+
+// A run of consecutive block numbers being collected for a range release
+typedef struct block_run {
+    unsigned long start;
+    unsigned long count;
+} block_run_t;
+
 /* file_descriptor_table_t should be an -opaque- type */
 typedef struct file_descriptor_table {
     struct list_head list;
@@ -72,4 +243,4 @@ typedef struct file_descriptor_table {
 } file_descriptor_table_t;
 
 /* Directory -block- has BLK_SZ / sizeof(directory_entry_t)
-   directory entries == 16 entries */
\ No newline at end of file
+   directory entries == 8 entries */
\ No newline at end of file
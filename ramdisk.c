@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "ramdisk.h"
 #include "ramdisk_module.h"
 
@@ -18,9 +20,14 @@ int rd_init() {
     if (rdfile == -1)
         return -1;
     retval = ioctl(rdfile, RD_INIT, NULL);
-    if (retval == 0 || errno == EALREADY)
-        rdfd = rdfile;
-    return retval;
+    // another process may have initialized the ramdisk already
+    if (retval < 0 && errno != EALREADY) {
+        perror("rd_init\n");
+        close(rdfile);
+        return -1;
+    }
+    rdfd = rdfile;
+    return 0;
 }
 
 int rd_creat(char *pathname) {
@@ -88,7 +95,7 @@ int rd_write(int fd, char *address, int num_bytes) {
     return ret;
 }
 
-int rd_lseek(int fd, int offset) {
+int rd_lseek(int fd, long long offset) {
     int ret = 0;
     rd_seek_arg_t arg = {
             .fd = fd,
@@ -122,3 +129,115 @@ int rd_readdir(int fd, char *address) {
         perror("rd_readdir\n");
     return ret;
 }
+
+int rd_setnode(int fd, int node) {
+    int ret = 0;
+    rd_setnode_arg_t arg = {
+            .fd = fd,
+            .node = node
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_SETNODE, &arg)) < 0)
+        perror("rd_setnode\n");
+    return ret;
+}
+
+int rd_fallocate(int fd, int mode, long long offset, long long length) {
+    int ret = 0;
+    rd_fallocate_arg_t arg = {
+            .fd = fd,
+            .mode = mode,
+            .offset = offset,
+            .length = length
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_FALLOCATE, &arg)) < 0)
+        perror("rd_fallocate\n");
+    return ret;
+}
+
+int rd_truncate(char *pathname, long long length) {
+    int ret = 0;
+    rd_truncate_arg_t arg = {
+            .pathname = pathname,
+            .length = length
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_TRUNCATE, &arg)) < 0)
+        perror("rd_truncate\n");
+    return ret;
+}
+
+int rd_ftruncate(int fd, long long length) {
+    int ret = 0;
+    rd_ftruncate_arg_t arg = {
+            .fd = fd,
+            .length = length
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_FTRUNCATE, &arg)) < 0)
+        perror("rd_ftruncate\n");
+    return ret;
+}
+
+int rd_pread(int fd, char *address, int num_bytes, long long offset) {
+    int ret = 0;
+    rd_prwfile_arg_t arg = {
+            .address = address,
+            .fd = fd,
+            .num_bytes = num_bytes,
+            .offset = offset
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_PREAD, &arg)) < 0)
+        perror("rd_pread\n");
+    return ret;
+}
+
+int rd_pwrite(int fd, char *address, int num_bytes, long long offset) {
+    int ret = 0;
+    rd_prwfile_arg_t arg = {
+            .address = address,
+            .fd = fd,
+            .num_bytes = num_bytes,
+            .offset = offset
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_PWRITE, &arg)) < 0)
+        perror("rd_pwrite\n");
+    return ret;
+}
+
+int rd_readv(int fd, const struct iovec *iov, int iovcnt) {
+    int ret = 0;
+    rd_rwvec_arg_t arg = {
+            .iov = iov,
+            .fd = fd,
+            .iovcnt = iovcnt
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_READV, &arg)) < 0)
+        perror("rd_readv\n");
+    return ret;
+}
+
+int rd_writev(int fd, const struct iovec *iov, int iovcnt) {
+    int ret = 0;
+    rd_rwvec_arg_t arg = {
+            .iov = iov,
+            .fd = fd,
+            .iovcnt = iovcnt
+    };
+    if (rd_init() < 0)
+        return -1;
+    if ((ret = ioctl(rdfd, RD_WRITEV, &arg)) < 0)
+        perror("rd_writev\n");
+    return ret;
+}
@@ -1,10 +1,19 @@
+struct iovec;  // from <sys/uio.h>
+
 int rd_creat(char *pathname);
 int rd_mkdir(char *pathname);
 int rd_open(char *pathname);
 int rd_close(int fd);
 int rd_read(int fd, char *address, int num_bytes);
 int rd_write(int fd, char *address, int num_bytes);
-int rd_lseek(int fd, int offset);
+int rd_lseek(int fd, long long offset);
 int rd_unlink(char *pathname);
 int rd_readdir(int fd, char *address);
-
+int rd_setnode(int fd, int node);
+int rd_fallocate(int fd, int mode, long long offset, long long length);
+int rd_truncate(char *pathname, long long length);
+int rd_ftruncate(int fd, long long length);
+int rd_pread(int fd, char *address, int num_bytes, long long offset);
+int rd_pwrite(int fd, char *address, int num_bytes, long long offset);
+int rd_readv(int fd, const struct iovec *iov, int iovcnt);
+int rd_writev(int fd, const struct iovec *iov, int iovcnt);
@@ -9,6 +9,17 @@
 #include <linux/init.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/uio.h>
 #include <asm/atomic.h>
 #include <linux/errno.h> /* error codes */
 #include <asm/uaccess.h> /* gives us get/put_user functions */
@@ -17,6 +28,20 @@
 
 MODULE_LICENSE("GPL");
 
+// size of the ramdisk, laid out when RD_INIT is called
+static unsigned long rd_size = DEFAULT_RD_SIZE;
+module_param(rd_size, ulong, 0444);
+MODULE_PARM_DESC(rd_size, "Total size of the ramdisk in bytes");
+static unsigned long rd_inodes = DEFAULT_INDEX_NODES;
+module_param(rd_inodes, ulong, 0444);
+MODULE_PARM_DESC(rd_inodes, "Number of index nodes, including the root directory");
+static bool rd_extents = false;
+module_param(rd_extents, bool, 0444);
+MODULE_PARM_DESC(rd_extents, "Map files with extent trees instead of direct and indirect block pointers");
+static bool rd_vmalloc_metadata = false;
+module_param(rd_vmalloc_metadata, bool, 0444);
+MODULE_PARM_DESC(rd_vmalloc_metadata, "Always vmalloc the super block, inode table and bitmap instead of using the direct map");
+
 // gobal declarations of ramdisk functions
 static int ramdisk_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
 static int rd_init(void);
@@ -26,6 +51,7 @@ static file_descriptor_table_t *get_file_descriptor_table(pid_t pid);
 static void delete_file_descriptor_table(pid_t pid);
 static int create_file_descriptor_table_entry(file_descriptor_table_t *fdt, file_object_t fo);
 static file_object_t get_file_descriptor_table_entry(file_descriptor_table_t *fdt, unsigned short fd);
+static index_node_t *get_file_descriptor_inode(file_descriptor_table_t *fdt, unsigned short fd);
 static int set_file_descriptor_table_entry(file_descriptor_table_t *fdt, unsigned short fd, file_object_t fo);
 static int delete_file_descriptor_table_entry(file_descriptor_table_t *fdt, unsigned short fd);
 static size_t get_file_descriptor_table_size(file_descriptor_table_t *fdt, unsigned short fd);
@@ -33,22 +59,107 @@ static index_node_t *get_free_index_node(void);
 static index_node_t *get_readlocked_parent_index_node(const char *pathname); // DOESNT TRASH PATHNAME
 static index_node_t *get_readlocked_index_node(const char *pathname);
 static index_node_t *get_inode(size_t no);
-static void *extend_inode(index_node_t *inode);
-static void *get_free_data_block(void);
-static void release_data_block(void *data_block_ptr);
+static size_t get_inode_number(index_node_t *inode);
+static void put_free_index_node(index_node_t *inode);
+static void *extend_inode(index_node_t *inode, block_reservation_t *res);
+static void *allocate_file_block(index_node_t *inode, unsigned long block_index, block_reservation_t *res);
+static int preallocate_blocks(index_node_t *inode, unsigned long first, unsigned long last);
+static unsigned long count_mapped_blocks(index_node_t *inode, loff_t size);
+static int block_path(unsigned long block_index, unsigned int *path);
+static void *lookup_block(index_node_t *inode, unsigned long block_index);
+static void *lookup_block_cached(index_node_t *inode, block_cursor_t *cursor, unsigned long block_index);
+static void *fill_block_cursor(block_cursor_t *cursor, index_node_t *inode, unsigned long block_index,
+                               block_num_t block_num, block_num_t leaf, unsigned int slot);
+static int map_block(index_node_t *inode, unsigned long block_index, block_num_t block_num, block_reservation_t *res,
+                     unsigned long goal);
+static void truncate_blocks(index_node_t *inode, unsigned long first);
+static bool truncate_tree(block_num_t node, int depth, unsigned long first, block_run_t *run,
+                          unsigned long *released);
+static int extent_search(extent_node_t *node, unsigned long block_index);
+static block_num_t extent_lookup(index_node_t *inode, unsigned long block_index, unsigned long *blocks_after);
+static int extent_map_block(index_node_t *inode, unsigned long block_index, block_num_t block_num,
+                            block_reservation_t *res, unsigned long goal);
+static void extent_insert(extent_node_t *node, int pos, const extent_t *entry);
+static void extent_truncate(index_node_t *inode, unsigned long first, block_run_t *run, unsigned long *released);
+static void extent_truncate_node(extent_node_t *node, unsigned long first, block_run_t *run,
+                                 unsigned long *released);
+static void add_extent_tree_to_run(extent_node_t *node, block_run_t *run, unsigned long *released);
+static int promote_inline_data(index_node_t *inode);
+static int truncate_inode(index_node_t *inode, loff_t size);
+static directory_entry_t *append_directory_entry(index_node_t *dir);
+static void add_tree_to_run(block_num_t node, int depth, unsigned long *data_blocks_left, block_run_t *run,
+                            unsigned long *released);
+static void *get_free_data_block(unsigned long goal);
+static void release_data_block(block_num_t block_num);
+static block_num_t lookup_block_num(index_node_t *inode, unsigned long block_index);
+static unsigned long get_free_data_extent(unsigned long wanted, unsigned long goal, unsigned long *start);
+static void release_data_extent(unsigned long start, unsigned long count);
+static void reserve_data_blocks(block_reservation_t *res, unsigned long wanted, unsigned long goal);
+static void *get_reserved_data_block(block_reservation_t *res, unsigned long goal);
+static void release_reserved_data_blocks(block_reservation_t *res);
+static long take_free_count(atomic_long_t *counter, long wanted);
+static int compute_layout(super_block_t *sb, unsigned long size, unsigned long inodes);
+static void free_ramdisk_memory(void);
+static bool claim_block_bit(unsigned long block_num);
+static void release_block_bit(unsigned long block_num);
+static unsigned long find_free_block(unsigned long block_num);
+static unsigned long find_free_block_wrap(unsigned long block_num);
+static unsigned long block_number(void *block_address);
+static void *data_block_address(unsigned long block_num);
+static void *populate_chunk(unsigned long chunk);
+static void *alloc_metadata(unsigned long size);
+static void split_node_pools(void);
+static unsigned long node_block_goal(int node);
+static void count_block_access(node_stats_t *stats, int node, void *block_address);
+static void free_chunk(void **pages, int count);
+static bool release_empty_chunk(unsigned long chunk);
+static unsigned long release_empty_chunks(unsigned long nr_to_release);
+static unsigned long count_empty_chunks(void);
+static int rd_shrink(int nr_to_scan, gfp_t gfp_mask);
+static unsigned long next_block_goal(index_node_t *inode, unsigned long block_index);
+static void rebuild_block_group_index(void);
+static int magazine_refill(block_magazine_t *mag, unsigned long goal);
+static void magazine_drain(block_magazine_t *mag);
+static unsigned long magazine_steal(void);
+static int magazine_cached_blocks(void);
+static void *prepare_data_block(unsigned long block_num);
+static long take_free_blocks(long wanted);
+static void wait_for_reclaim(unsigned long bytes);
+static void release_block_range(unsigned long start, unsigned long count);
+static void add_block_to_run(block_run_t *run, unsigned long block_num, unsigned long *released);
+static unsigned long release_mapped_blocks(index_node_t *mapping);
+static void defer_block_reclaim(index_node_t *inode);
+static void reclaim_pending_blocks(void);
+static void reclaim_work_fn(struct work_struct *work);
+static int zero_blocks_thread(void *data);
 static directory_entry_t *get_directory_entry(index_node_t *inode, int index);
-static void *get_byte_address(index_node_t *inode, int offset);
+static void *get_byte_address(index_node_t *inode, loff_t offset);
+static void *get_cached_byte_address(index_node_t *inode, block_cursor_t *cursor, loff_t offset);
+static unsigned long read_inode(index_node_t *inode, block_cursor_t *cursor, loff_t *pos, void *buf,
+                                unsigned long count);
+static unsigned long write_inode(index_node_t *inode, block_cursor_t *cursor, loff_t *pos, const void *buf,
+                                 unsigned long count);
 static int rd_creat(const char *usr_str);
 static int rd_mkdir(const char *usr_str);
 static int rd_open(const pid_t pid, const char *usr_str);
 static int rd_close(const pid_t pid, const int fd);
 static int rd_read(const pid_t pid, const rd_rwfile_arg_t *usr_arg);
 static int rd_write(const pid_t pid, const rd_rwfile_arg_t *usr_arg);
+static int rd_pread(const pid_t pid, const rd_prwfile_arg_t *usr_arg);
+static int rd_pwrite(const pid_t pid, const rd_prwfile_arg_t *usr_arg);
+static struct iovec *get_user_iovec(const rd_rwvec_arg_t *vec_arg, unsigned long *total);
+static int rd_readv(const pid_t pid, const rd_rwvec_arg_t *usr_arg);
+static int rd_writev(const pid_t pid, const rd_rwvec_arg_t *usr_arg);
 static int rd_lseek(const pid_t pid, const rd_seek_arg_t *usr_arg);
 static int rd_unlink(const char *usr_str);
 static int rd_readdir(const pid_t pid, const rd_readdir_arg_t *usr_arg);
+static int rd_setnode(const pid_t pid, const rd_setnode_arg_t *usr_arg);
+static int rd_fallocate(const pid_t pid, const rd_fallocate_arg_t *usr_arg);
+static int rd_truncate(const rd_truncate_arg_t *usr_arg);
+static int rd_ftruncate(const pid_t pid, const rd_ftruncate_arg_t *usr_arg);
 static int procfs_open(struct inode *inode, struct file *file);
 static int procfs_close(struct inode *inode, struct file *file);
+static int rd_stats_read_proc(char *page, char **start, off_t off, int count, int *eof, void *data);
 
 static struct file_operations ramdisk_file_ops = {
         .owner = THIS_MODULE,
@@ -62,23 +173,62 @@ static struct proc_dir_entry *proc_entry;
 // declarations of ramdisk synchronization
 // define locks to ensure consistency of ramdisk memory for multi processes access
 DEFINE_RWLOCK(rd_init_rwlock);
-DEFINE_SPINLOCK(super_block_spinlock);
-DEFINE_SPINLOCK(block_bitmap_spinlock);
+static DEFINE_MUTEX(rd_init_mutex);    // serializes RD_INIT, which has to sleep while allocating
 DEFINE_RWLOCK(index_nodes_rwlock);
 DEFINE_RWLOCK(file_descriptor_tables_rwlock);
+static DEFINE_PER_CPU(block_magazine_t, block_magazines);
+static DEFINE_PER_CPU(node_stats_t, node_stats);
 
 // declarations of ramdisk data structures
 static bool rd_initialized_flag = false;
 static super_block_t *super_block = NULL;
-static index_node_t *index_nodes = NULL;    // 256 blocks/64 bytes per inode = 1024 inodes
-static void *block_bitmap = NULL; // 4 blocks => block_bitmap is 1024 bytes long
-static void *data_blocks = NULL; // len(data_blocks) == 7931 blocks
+static index_node_t *index_nodes = NULL;    // rd_inodes inodes, rounded up to fill the last block
+static void *block_bitmap = NULL; // one bit per data block
+// the data blocks are backed by one CHUNK_SIZE chunk of single pages per block group, allocated on first use
+static void **chunk_pages = NULL;   // PAGES_PER_CHUNK page addresses per chunk, all NULL if it isn't backed
+static DEFINE_SPINLOCK(chunk_install_spinlock);
+static atomic_long_t populated_chunks = ATOMIC_LONG_INIT(0);
+static atomic_long_t chunk_alloc_failures = ATOMIC_LONG_INIT(0);
+static atomic_long_t chunks_released = ATOMIC_LONG_INIT(0);
+static int metadata_order = -1;     // page order of the metadata, or -1 if it was vmalloced
+static struct shrinker rd_shrinker = {
+        .shrink = rd_shrink,
+        .seeks = DEFAULT_SEEKS,
+};
+// copies of the layout in super_block, for the hot paths
+static unsigned long num_data_blocks = 0;
+static unsigned long num_index_nodes = 0;
+static unsigned long num_block_groups = 0;
+// free-space index over block_bitmap, updated with atomic operations and rebuilt in rd_init
+static atomic_t *block_group_free = NULL;           // free blocks in each group
+static unsigned long *block_group_summary = NULL;   // bit set if the group has a free block
+// the block groups are split into one contiguous pool per online NUMA node, backed by that node's memory
+static unsigned long pool_start[MAX_NUMNODES + 1];  // first block group of each node's pool, empty if offline
+static unsigned long node_rotor[MAX_NUMNODES];  // next-fit start in each pool for allocations without a goal, only a hint
+static unsigned short *chunk_node = NULL;   // node of the pool each block group belongs to
+// "known zero" bit per data block, set by zero_blocks_thread and consumed by prepare_data_block.
+// Blocks of a chunk that isn't backed are zero by definition and keep their bit set.
+static unsigned long *block_zeroed = NULL;
+static atomic_long_t zeroed_free_blocks = ATOMIC_LONG_INIT(0);    // known zero blocks of backed chunks only
+static bool zero_blocks_requested = false;  // set by allocations that had to zero a block themselves
+static struct task_struct *zero_blocks_task = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(zero_blocks_wait);
+// block trees of unlinked files waiting to be freed by reclaim_work
+static LIST_HEAD(reclaim_list);
+static DEFINE_SPINLOCK(reclaim_list_spinlock);
+static atomic_long_t pending_reclaim_blocks = ATOMIC_LONG_INIT(0);
+static struct workqueue_struct *reclaim_wq = NULL;
+static DECLARE_WORK(reclaim_work, reclaim_work_fn);
 static int temp = 0;
 static LIST_HEAD(file_descriptor_tables);
+// LIFO of free inode numbers, so the most recently freed (cache-hot) inode is reused first
+static unsigned int *free_inode_stack = NULL;
+static unsigned long free_inode_top = 0;
+static DEFINE_SPINLOCK(free_inode_spinlock);
 
-#define INODE_PTR(index) (index_node_t *) (((void *) index_nodes) + index * INDEX_NODE_SIZE)
-#define BLOCK_START(byte_address) ((void *)byte_address - (((unsigned long) ((void *)byte_address - data_blocks)) % BLOCK_SIZE))
-#define BLOCK_END(byte_address) (BLOCK_START(byte_address) + BLOCK_SIZE)
+#define INDIRECT_BLOCK(block_num) ((indirect_block_t *) data_block_address(block_num))
+#define EXTENT_BLOCK(block_num) ((extent_node_t *) data_block_address(block_num))
+#define CHUNK_BACKED(chunk) (chunk_pages[(chunk) * PAGES_PER_CHUNK] != NULL)
 
 /*
  *
@@ -109,8 +259,11 @@ static int procfs_close(struct inode *inode, struct file *file) {
         }
         delete_file_descriptor_table(current->pid);
     }
-    printk("Num data_blocks remaining: %d\n", super_block->num_free_blocks);
-    printk("Num inodes remaining: %d\n", super_block->num_free_inodes);
+    // RD_INIT may have failed, e.g. on bad module parameters, leaving no super block
+    if (rd_initialized()) {
+        printk("Num data_blocks remaining: %ld\n", atomic_long_read(&super_block->num_free_blocks) + magazine_cached_blocks());
+        printk("Num inodes remaining: %ld\n", atomic_long_read(&super_block->num_free_inodes));
+    }
     module_put(THIS_MODULE);
     return 0;
 }
@@ -125,19 +278,38 @@ static int __init initialization_routine(void) {
         return 1;
     }
     proc_entry->proc_fops = &ramdisk_file_ops;
+    if (!create_proc_read_entry("ramdisk_stats", 0444, NULL, rd_stats_read_proc, NULL)) {
+        printk(KERN_ERR "Error creating /proc stats entry. \n");
+        remove_proc_entry("ramdisk", NULL);
+        return 1;
+    }
+    reclaim_wq = create_singlethread_workqueue("rd_reclaim");
+    if (!reclaim_wq) {
+        printk(KERN_ERR "Error creating reclaim workqueue. \n");
+        remove_proc_entry("ramdisk_stats", NULL);
+        remove_proc_entry("ramdisk", NULL);
+        return 1;
+    }
+    register_shrinker(&rd_shrinker);
     return 0;
 }
 
 static void __exit cleanup_routine(void) {
     file_descriptor_table_t *p = NULL, *next = NULL;
+    remove_proc_entry("ramdisk_stats", NULL);
     remove_proc_entry("ramdisk", NULL);
     printk(KERN_INFO "Cleaning up ramdisk module\n");
     list_for_each_entry_safe(p, next, &file_descriptor_tables, list){
         delete_file_descriptor_table(p->owner);
     }
+    unregister_shrinker(&rd_shrinker);
+    if (zero_blocks_task != NULL)
+        kthread_stop(zero_blocks_task);
+    flush_workqueue(reclaim_wq);
+    destroy_workqueue(reclaim_wq);
     if (super_block != NULL) {
         printk(KERN_INFO "Freeing ramdisk memory\n");
-        vfree(super_block);
+        free_ramdisk_memory();
     }
     return;
 }
@@ -145,15 +317,14 @@ static void __exit cleanup_routine(void) {
 
 // ioctl() entry point
 static int ramdisk_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg) {
-    printk(KERN_INFO "Called ioctl\n");
     if (cmd != RD_INIT && !rd_initialized()) {
         printk(KERN_ERR "Ramdisk called before being initialized\n");
         return -1;
     }
     switch (cmd) {
         case RD_INIT:
-            rd_init();
-            break;
+            // -EINVAL for bad module parameters, -ENOMEM if the metadata can't be allocated
+            return rd_init();
         case RD_CREAT:
             return rd_creat((char *) arg);
         case RD_MKDIR:
@@ -166,12 +337,28 @@ static int ramdisk_ioctl(struct inode *inode, struct file *filp, unsigned int cm
             return rd_read(current->pid, (rd_rwfile_arg_t *) arg);
         case RD_WRITE:
             return rd_write(current->pid, (rd_rwfile_arg_t *) arg);
+        case RD_PREAD:
+            return rd_pread(current->pid, (rd_prwfile_arg_t *) arg);
+        case RD_PWRITE:
+            return rd_pwrite(current->pid, (rd_prwfile_arg_t *) arg);
+        case RD_READV:
+            return rd_readv(current->pid, (rd_rwvec_arg_t *) arg);
+        case RD_WRITEV:
+            return rd_writev(current->pid, (rd_rwvec_arg_t *) arg);
         case RD_LSEEK:
             return rd_lseek(current->pid, (rd_seek_arg_t *) arg);
         case RD_UNLINK:
             return rd_unlink((char *) arg);
         case RD_READDIR:
             return rd_readdir(current->pid, (rd_readdir_arg_t *) arg);
+        case RD_SETNODE:
+            return rd_setnode(current->pid, (rd_setnode_arg_t *) arg);
+        case RD_FALLOCATE:
+            return rd_fallocate(current->pid, (rd_fallocate_arg_t *) arg);
+        case RD_TRUNCATE:
+            return rd_truncate((rd_truncate_arg_t *) arg);
+        case RD_FTRUNCATE:
+            return rd_ftruncate(current->pid, (rd_ftruncate_arg_t *) arg);
         default:
             printk("Unrecognized cmd %u\n", cmd);
             return -EINVAL;
@@ -278,8 +465,7 @@ static int create_file_descriptor_table_entry(file_descriptor_table_t *fdt, file
     }
     if (dest == NULL)
         return -ENOMEM;
-    dest->index_node = fo.index_node;
-    dest->file_position = fo.file_position;
+    *dest = fo;
     return entry_index;
 }
 
@@ -293,11 +479,21 @@ static file_object_t get_file_descriptor_table_entry(file_descriptor_table_t *fd
     if (fd >= (fdt->entries_length)) {
         return ret;
     }
-    ret.index_node = fdt->entries[fd].index_node;
-    ret.file_position = fdt->entries[fd].file_position;
+    ret = fdt->entries[fd];
     return ret;
 }
 
+/*
+ * Returns the index node open as fd, or NULL. Unlike copying the whole
+ * entry, this can't catch a half updated cursor from a concurrent
+ * set_file_descriptor_table_entry.
+ */
+static index_node_t *get_file_descriptor_inode(file_descriptor_table_t *fdt, unsigned short fd) {
+    if (fd >= fdt->entries_length)
+        return NULL;
+    return fdt->entries[fd].index_node;
+}
+
 /*
  * Sets the file descriptor table entry assocated with the given file descriptor
  * to the given file_object value.
@@ -325,39 +521,44 @@ static size_t get_file_descriptor_table_size(file_descriptor_table_t *fdt, unsig
 
 // Returns a pointer to a free index_node_t, if one exists, NULL on error
 static index_node_t *get_free_index_node() {
-    int i = 0, direct_ptr_index = 0;
-    index_node_t *new_inode = NULL, *p = NULL;
+    index_node_t *new_inode = NULL;
     // make sure there is a free inode/ decrement inodes counter in superblock
-    spin_lock(&super_block_spinlock);
-    if (super_block->num_free_inodes == 0) {
-        spin_unlock(&super_block_spinlock);
+    if (take_free_count(&super_block->num_free_inodes, 1) == 0)
+        return NULL;
+    // Pop the most recently freed inode
+    spin_lock(&free_inode_spinlock);
+    if (free_inode_top > 0)
+        new_inode = get_inode(free_inode_stack[--free_inode_top]);
+    spin_unlock(&free_inode_spinlock);
+    if (new_inode == NULL) {
+        printk(KERN_ERR "Free inode list has fewer inodes than the super block claims\n");
+        atomic_long_inc(&super_block->num_free_inodes);
         return NULL;
     }
-    super_block->num_free_inodes--;
-    spin_unlock(&super_block_spinlock);
-    // Look for an UNALLOCATED inode
-    for (i = 0; i < INDEX_NODES; i++) {
-        p = get_inode(i);
-        if (write_trylock(&p->file_lock)) {
-            if (p->type == UNALLOCATED) {
-                new_inode = p;
-                new_inode->type = ALLOCATED;
-                new_inode->size = 0;
-                atomic_set(&new_inode->open_count, 0);
-                for (direct_ptr_index = 0; direct_ptr_index < DIRECT; direct_ptr_index++)
-                    new_inode->direct[direct_ptr_index] = NULL;
-                new_inode->single_indirect = NULL;
-                new_inode->double_indirect = NULL;
-                write_unlock(&new_inode->file_lock);
-                break;
-            } else {
-                write_unlock(&p->file_lock);
-            }
-        }
-    }
+    // nobody else can reach an inode on the free list, so this never waits
+    write_lock(&new_inode->file_lock);
+    new_inode->type = ALLOCATED;
+    new_inode->flags = INODE_INLINE | (rd_extents ? INODE_EXTENTS : 0);
+    new_inode->size = 0;
+    atomic_set(&new_inode->open_count, 0);
+    // clears the pointers and the inline bytes past them
+    memset(INLINE_DATA(new_inode), 0, INLINE_DATA_SIZE);
+    new_inode->home_node = NO_HOME_NODE;
+    write_unlock(&new_inode->file_lock);
     return new_inode;
 }
 
+/*
+ *  Puts the UNALLOCATED inode back on the free list and makes it available
+ *  to get_free_index_node. To be called without any lock on inode held.
+ */
+static void put_free_index_node(index_node_t *inode) {
+    spin_lock(&free_inode_spinlock);
+    free_inode_stack[free_inode_top++] = get_inode_number(inode);
+    spin_unlock(&free_inode_spinlock);
+    atomic_long_inc(&super_block->num_free_inodes);
+}
+
 
 // Returns the index node of directory containing the file indicated by pathname, or NULL on error.
 static index_node_t *get_readlocked_parent_index_node(const char *pathname) {
@@ -404,11 +605,14 @@ static index_node_t *get_readlocked_index_node(const char *pathname) {
         }
         found_prev_inode = false;
         for (i = 0; i < curr->size / sizeof(directory_entry_t); i++) {
-            dir_entry = get_byte_address(curr, i * sizeof(directory_entry_t));
+            if (curr->flags & INODE_INLINE)
+                dir_entry = (directory_entry_t *) INLINE_DATA(curr) + i;
+            else
+                dir_entry = get_byte_address(curr, i * sizeof(directory_entry_t));
             if (strncmp(dir_entry->filename, token, MAX_FILE_NAME_LEN) == 0) {
                 found_prev_inode = true;
                 prev = curr;
-                curr = INODE_PTR(dir_entry->index_node_number);
+                curr = get_inode(dir_entry->index_node_number);
                 read_lock(&curr->file_lock);
                 read_unlock(&prev->file_lock);
                 break;
@@ -432,79 +636,575 @@ static index_node_t *get_inode(size_t index) {
     return (index_node_t *) (((void *) index_nodes) + INDEX_NODE_SIZE * index);
 }
 
+// Returns the index of inode in the index node table
+static size_t get_inode_number(index_node_t *inode) {
+    return ((void *) inode - (void *) index_nodes) / INDEX_NODE_SIZE;
+}
 
-// to be called with write lock held!
-static void *extend_inode(index_node_t *inode) {
-    void *extending_block;
-    if (inode->size >= MAX_FILE_SIZE - BLOCK_SIZE + 1) {
-        // there's no room for another block for this file
+
+/*
+ *  Splits file block block_index into the slot to follow at every level of
+ *  the tree that maps it, root first. Returns the depth of that tree, 0 for
+ *  a direct block, or -1 if the block is past MAX_FILE_SIZE.
+ */
+static int block_path(unsigned long block_index, unsigned int *path) {
+    unsigned long span = 1;
+    int depth = 0, level = 0;
+    if (block_index < DIRECT) {
+        path[0] = block_index;
+        return 0;
+    }
+    block_index -= DIRECT;
+    for (depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+        span *= POINTER_PER_BLOCK;
+        if (block_index < span) {
+            for (level = depth - 1; level >= 0; level--) {
+                path[level] = block_index % POINTER_PER_BLOCK;
+                block_index /= POINTER_PER_BLOCK;
+            }
+            return depth;
+        }
+        block_index -= span;
+    }
+    return -1;
+}
+
+/*
+ *  Returns the number of the data block that maps file block block_index of
+ *  inode, or 0 if it isn't mapped. To be called with a lock on inode held.
+ */
+static block_num_t lookup_block_num(index_node_t *inode, unsigned long block_index) {
+    unsigned int path[INDIRECT_LEVELS];
+    int depth = 0, level = 0;
+    block_num_t node = 0;
+    if (inode->flags & INODE_EXTENTS)
+        return extent_lookup(inode, block_index, NULL);
+    depth = block_path(block_index, path);
+    if (depth <= 0)
+        return depth == 0 ? inode->direct[path[0]] : 0;
+    node = inode->indirect[depth - 1];
+    for (level = 0; level < depth && node != 0; level++)
+        node = INDIRECT_BLOCK(node)->data[path[level]];
+    return node;
+}
+
+/*
+ *  Returns the data block that maps file block block_index of inode, or NULL
+ *  if it isn't mapped. To be called with a lock on inode held.
+ */
+static void *lookup_block(index_node_t *inode, unsigned long block_index) {
+    block_num_t block_num = lookup_block_num(inode, block_index);
+    return block_num != 0 ? data_block_address(block_num) : NULL;
+}
+
+/*
+ *  Like lookup_block, but through cursor: the block cursor points at is
+ *  returned right away, and the block after it is read from the same
+ *  indirect block or direct slot. Anything else walks the tree and points
+ *  cursor at the block found. To be called with a lock on inode held.
+ */
+static void *lookup_block_cached(index_node_t *inode, block_cursor_t *cursor, unsigned long block_index) {
+    unsigned int path[INDIRECT_LEVELS];
+    int depth = 0, level = 0;
+    block_num_t node = 0, leaf = 0;
+    unsigned long blocks_after = 0;
+    if (cursor->block_address != NULL && cursor->generation == inode->generation) {
+        if (block_index == cursor->block_index)
+            return cursor->block_address;
+        if (block_index == cursor->block_index + 1) {
+            if (inode->flags & INODE_EXTENTS) {
+                // the next block of an extent is the next data block
+                if (cursor->slot > 0)
+                    return fill_block_cursor(cursor, inode, block_index, cursor->block_num + 1, 0, cursor->slot - 1);
+            } else if (cursor->leaf == 0 && block_index < DIRECT)
+                node = inode->direct[block_index];
+            else if (cursor->leaf != 0 && cursor->slot + 1 < POINTER_PER_BLOCK)
+                node = INDIRECT_BLOCK(cursor->leaf)->data[cursor->slot + 1];
+            if (node != 0)
+                return fill_block_cursor(cursor, inode, block_index, node, cursor->leaf, cursor->slot + 1);
+        }
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        node = extent_lookup(inode, block_index, &blocks_after);
+        return node != 0 ? fill_block_cursor(cursor, inode, block_index, node, 0, blocks_after) : NULL;
+    }
+    depth = block_path(block_index, path);
+    if (depth < 0)
         return NULL;
+    if (depth == 0) {
+        node = inode->direct[path[0]];
+    } else {
+        node = inode->indirect[depth - 1];
+        for (level = 0; level < depth && node != 0; level++) {
+            leaf = node;
+            node = INDIRECT_BLOCK(node)->data[path[level]];
+        }
     }
+    if (node == 0)
+        return NULL;
+    return fill_block_cursor(cursor, inode, block_index, node, leaf, path[depth > 0 ? depth - 1 : 0]);
+}
+
+// Points cursor at data block block_num, file block block_index of inode, and returns its address
+static void *fill_block_cursor(block_cursor_t *cursor, index_node_t *inode, unsigned long block_index,
+                               block_num_t block_num, block_num_t leaf, unsigned int slot) {
+    cursor->block_index = block_index;
+    cursor->block_address = data_block_address(block_num);
+    cursor->block_num = block_num;
+    cursor->leaf = leaf;
+    cursor->slot = slot;
+    cursor->generation = inode->generation;
+    return cursor->block_address;
+}
 
-    // Get new data block to extend inode with
-    extending_block = get_free_data_block();
-    if (inode->size < DIRECT * BLOCK_SIZE) {
-        // Can link to new block from one of the DIRECT pointers
-        inode->direct[inode->size / BLOCK_SIZE] = extending_block;
-    } else if (inode->size < BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) {
-        // Can link to new block from one of the INDIRECT pointers
-        if (inode->size == DIRECT * BLOCK_SIZE) {
-            // Need to make the INDIRECT block
-            indirect_block_t *indirect_block = get_free_data_block();
-            if (indirect_block == NULL) {
-                return NULL;
+/*
+ *  Links block block_num as file block block_index of inode, allocating the
+ *  indirect blocks on its path that don't exist yet from res, as close to
+ *  goal as possible. Returns 0, or -ENOSPC after undoing any indirect block
+ *  it allocated. To be called with write lock held.
+ */
+static int map_block(index_node_t *inode, unsigned long block_index, block_num_t block_num, block_reservation_t *res,
+                     unsigned long goal) {
+    unsigned int path[INDIRECT_LEVELS];
+    int depth = 0, level = 0, allocated = 0;
+    block_num_t *slot = NULL, *first_new_slot = NULL, new_blocks[INDIRECT_LEVELS];
+    void *new_block = NULL;
+    if (inode->flags & INODE_EXTENTS)
+        return extent_map_block(inode, block_index, block_num, res, goal);
+    depth = block_path(block_index, path);
+    if (depth < 0)
+        return -ENOSPC;
+    if (depth == 0) {
+        inode->direct[path[0]] = block_num;
+        return 0;
+    }
+    slot = &inode->indirect[depth - 1];
+    for (level = 0; level < depth; level++) {
+        if (*slot == 0) {
+            new_block = get_reserved_data_block(res, goal);
+            if (new_block == NULL) {
+                if (first_new_slot != NULL)
+                    *first_new_slot = 0;
+                while (allocated > 0)
+                    release_data_block(new_blocks[--allocated]);
+                return -ENOSPC;
             }
-            inode->single_indirect = indirect_block;
-            indirect_block->data[0] = (void *) extending_block;
-        } else {
-            // Indirect block already exists
-            inode->single_indirect->data[(inode->size / BLOCK_SIZE) - DIRECT] = (void *) extending_block;
+            if (first_new_slot == NULL)
+                first_new_slot = slot;
+            new_blocks[allocated] = block_number(new_block);
+            *slot = new_blocks[allocated++];
         }
+        slot = &INDIRECT_BLOCK(*slot)->data[path[level]];
+    }
+    *slot = block_num;
+    return 0;
+}
+
+/*
+ *  Unmaps file blocks first and up of inode and releases them along with the
+ *  indirect or extent tree blocks left empty, in one batched pass with a
+ *  single update of num_free_blocks. To be called with write lock held.
+ */
+static void truncate_blocks(index_node_t *inode, unsigned long first) {
+    unsigned long released = 0, base = DIRECT, span = 1, i = 0;
+    block_run_t run = {.start = 0, .count = 0};
+    int depth = 0;
+    // block cursors may point at the blocks or their indirect blocks
+    inode->generation++;
+    if (inode->flags & INODE_EXTENTS) {
+        extent_truncate(inode, first, &run, &released);
     } else {
-        // Need to link to new block from an INDIRECT block, that is pointed to from the DOUBLE_INDIRECT block
-        if (inode->size == BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) {
-            // Need to create the DOUBLE INDIRECT block
-            double_indirect_block_t *double_indirect_block = get_free_data_block();
-            indirect_block_t *indirect_block = get_free_data_block();
-            if (indirect_block == NULL || double_indirect_block == NULL) {
-                if (indirect_block != NULL)
-                    release_data_block(indirect_block);
-                if (double_indirect_block != NULL)
-                    release_data_block(double_indirect_block);
-                release_data_block(extending_block);
-                return NULL;
-            }
-            inode->double_indirect = double_indirect_block;
-            double_indirect_block->indirect_blocks[0] = indirect_block;
-            indirect_block->data[0] = (void *) extending_block;
-        } else if ((inode->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) % (POINTER_PER_BLOCK * BLOCK_SIZE) != 0) {
-            // Can point to the new block from  a prexisting indirect block
-            int indirect_block_index =
-                    (inode->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) / (POINTER_PER_BLOCK * BLOCK_SIZE);
-            int index_in_indirect_block =
-                    ((inode->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) % (POINTER_PER_BLOCK * BLOCK_SIZE)) / BLOCK_SIZE;
-            inode->double_indirect->indirect_blocks[indirect_block_index]
-                    ->data[index_in_indirect_block] = (void *) extending_block;
-        } else if ((inode->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) % (POINTER_PER_BLOCK * BLOCK_SIZE) == 0) {
-            // Need to create a new indirect block to point to the new block
-            indirect_block_t *indirect_block = get_free_data_block();
-            if (indirect_block == NULL) {
-                release_data_block(extending_block);
-                return NULL;
+        for (i = first; i < DIRECT; i++) {
+            add_block_to_run(&run, inode->direct[i], &released);
+            inode->direct[i] = 0;
+        }
+        for (depth = 1; depth <= INDIRECT_LEVELS; depth++) {
+            span *= POINTER_PER_BLOCK;
+            if (inode->indirect[depth - 1] != 0 && first < base + span &&
+                truncate_tree(inode->indirect[depth - 1], depth, first > base ? first - base : 0, &run, &released)) {
+                add_block_to_run(&run, inode->indirect[depth - 1], &released);
+                inode->indirect[depth - 1] = 0;
             }
-            int indirect_block_index =
-                    (inode->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) / (POINTER_PER_BLOCK * BLOCK_SIZE);
-            int index_in_indirect_block = 0;
-            inode->double_indirect->indirect_blocks[indirect_block_index]
-                    = indirect_block;
-            inode->double_indirect->indirect_blocks[indirect_block_index]
-                    ->data[index_in_indirect_block] = (void *) extending_block;
+            base += span;
+        }
+    }
+    release_block_range(run.start, run.count);
+    released += run.count;
+    if (released > 0)
+        atomic_long_add(released, &super_block->num_free_blocks);
+}
+
+/*
+ *  Unmaps the blocks of the tree under indirect block node, depth levels deep,
+ *  from block first of the tree on and adds them to run. Returns true if node
+ *  maps nothing anymore, for the caller to release it.
+ */
+static bool truncate_tree(block_num_t node, int depth, unsigned long first, block_run_t *run,
+                          unsigned long *released) {
+    indirect_block_t *indirect_block = INDIRECT_BLOCK(node);
+    unsigned long span = 1;
+    unsigned int i = 0, first_slot = 0;
+    for (i = 1; i < depth; i++)
+        span *= POINTER_PER_BLOCK;
+    first_slot = first / span;
+    for (i = first_slot; i < POINTER_PER_BLOCK; i++) {
+        if (indirect_block->data[i] == 0)
+            continue;
+        if (depth > 1 && !truncate_tree(indirect_block->data[i], depth - 1, i == first_slot ? first % span : 0,
+                                        run, released))
+            continue;
+        add_block_to_run(run, indirect_block->data[i], released);
+        indirect_block->data[i] = 0;
+    }
+    // only the slots up to first_slot can still map something, holes may have left them empty
+    for (i = 0; i <= first_slot; i++)
+        if (indirect_block->data[i] != 0)
+            return false;
+    return true;
+}
+
+/*
+ *  Returns the position of the last entry of node that starts at or before
+ *  file block block_index, or -1 if there is none.
+ */
+static int extent_search(extent_node_t *node, unsigned long block_index) {
+    int low = 0, high = node->header.count - 1, mid = 0;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (node->extents[mid].logical <= block_index)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return high;
+}
+
+/*
+ *  Returns the number of the data block that maps file block block_index of
+ *  the INODE_EXTENTS inode, or 0 if it isn't mapped. If blocks_after isn't
+ *  NULL it gets the number of blocks that follow in the same extent.
+ *  To be called with a lock on inode held.
+ */
+static block_num_t extent_lookup(index_node_t *inode, unsigned long block_index, unsigned long *blocks_after) {
+    extent_node_t *node = EXTENT_ROOT(inode);
+    extent_t *extent = NULL;
+    int pos = extent_search(node, block_index);
+    while (pos >= 0 && node->header.depth > 0) {
+        node = EXTENT_BLOCK(node->extents[pos].start);
+        pos = extent_search(node, block_index);
+    }
+    if (pos < 0)
+        return 0;
+    extent = &node->extents[pos];
+    if (block_index >= extent->logical + extent->length)
+        return 0;
+    if (blocks_after != NULL)
+        *blocks_after = extent->logical + extent->length - 1 - block_index;
+    return extent->start + (block_index - extent->logical);
+}
+
+/*
+ *  map_block for an INODE_EXTENTS inode. Grows the extent that ends just
+ *  before block_index if block_num continues it, and inserts a new extent
+ *  otherwise. Full nodes are split on the way back up, and a full root moves
+ *  its entries down into a new tree block, one level deeper. The tree blocks
+ *  needed are all taken from res, as close to goal as possible, before the
+ *  tree is touched. Returns 0, -EEXIST if block_index is already mapped, or
+ *  -ENOSPC. To be called with write lock held.
+ */
+static int extent_map_block(index_node_t *inode, unsigned long block_index, block_num_t block_num,
+                            block_reservation_t *res, unsigned long goal) {
+    extent_node_t *path[EXTENT_MAX_DEPTH + 1], *node = NULL, *split = NULL;
+    extent_t entry = {.logical = block_index, .start = block_num, .length = 1}, *prev = NULL;
+    block_num_t new_blocks[EXTENT_MAX_DEPTH + 1];
+    void *new_block = NULL;
+    int depth = EXTENT_ROOT(inode)->header.depth, level = 0, pos = 0, needed = 0, used = 0, moved = 0;
+    path[0] = EXTENT_ROOT(inode);
+    for (level = 0; level < depth; level++) {
+        pos = extent_search(path[level], block_index);
+        if (pos < 0) {
+            // block_index comes before anything mapped so far, lower the first key on the way
+            pos = 0;
+            path[level]->extents[0].logical = block_index;
+        }
+        path[level + 1] = EXTENT_BLOCK(path[level]->extents[pos].start);
+    }
+    node = path[depth];
+    pos = extent_search(node, block_index);
+    if (pos >= 0) {
+        prev = &node->extents[pos];
+        if (block_index < prev->logical + prev->length)
+            return -EEXIST;
+        if (prev->logical + prev->length == block_index && prev->start + prev->length == block_num) {
+            prev->length++;
+            return 0;
+        }
+    }
+    // every full node on the way up needs a new block: a sibling, or a new child for the root
+    for (level = depth; level >= 0 && path[level]->header.count == (level == 0 ? ROOT_EXTENTS : EXTENTS_PER_BLOCK);
+         level--)
+        needed++;
+    if (level < 0 && depth == EXTENT_MAX_DEPTH)
+        return -ENOSPC;
+    for (used = 0; used < needed; used++) {
+        new_block = get_reserved_data_block(res, goal);
+        if (new_block == NULL) {
+            while (used > 0)
+                release_data_block(new_blocks[--used]);
+            return -ENOSPC;
+        }
+        new_blocks[used] = block_number(new_block);
+    }
+    used = 0;
+    for (level = depth; level >= 0; level--) {
+        node = path[level];
+        pos = extent_search(node, entry.logical) + 1;
+        if (node->header.count < (level == 0 ? ROOT_EXTENTS : EXTENTS_PER_BLOCK)) {
+            extent_insert(node, pos, &entry);
+            return 0;
+        }
+        split = EXTENT_BLOCK(new_blocks[used]);
+        if (level == 0) {
+            // a tree block holds more entries than the root, so the entry fits once they moved down
+            memcpy(split, node, EXTENT_HEADER_SIZE + node->header.count * EXTENT_SIZE);
+            extent_insert(split, pos, &entry);
+            memset(node->extents, 0, ROOT_EXTENTS * EXTENT_SIZE);
+            node->header.count = 1;
+            node->header.depth++;
+            node->extents[0].logical = split->extents[0].logical;
+            node->extents[0].start = new_blocks[used];
+            return 0;
+        }
+        // appends start a new block, inserts in the middle split the node in half
+        moved = pos == node->header.count ? 0 : node->header.count / 2;
+        split->header.depth = node->header.depth;
+        split->header.count = moved;
+        memcpy(split->extents, node->extents + node->header.count - moved, moved * EXTENT_SIZE);
+        memset(node->extents + node->header.count - moved, 0, moved * EXTENT_SIZE);
+        node->header.count -= moved;
+        if (moved == 0 || pos > node->header.count)
+            extent_insert(split, pos - node->header.count, &entry);
+        else
+            extent_insert(node, pos, &entry);
+        entry.logical = split->extents[0].logical;
+        entry.start = new_blocks[used++];
+        entry.length = 0;
+    }
+    return 0;
+}
+
+// Inserts entry at position pos of node, which must have room for it
+static void extent_insert(extent_node_t *node, int pos, const extent_t *entry) {
+    memmove(node->extents + pos + 1, node->extents + pos, (node->header.count - pos) * EXTENT_SIZE);
+    node->extents[pos] = *entry;
+    node->header.count++;
+}
+
+/*
+ *  Unmaps file blocks first and up of the INODE_EXTENTS inode and adds them
+ *  to run along with the tree blocks left empty. To be called with write
+ *  lock held.
+ */
+static void extent_truncate(index_node_t *inode, unsigned long first, block_run_t *run, unsigned long *released) {
+    extent_node_t *root = EXTENT_ROOT(inode);
+    extent_truncate_node(root, first, run, released);
+    if (root->header.count == 0)
+        root->header.depth = 0;
+}
+
+// Unmaps file blocks first and up under node, from the last entry backwards
+static void extent_truncate_node(extent_node_t *node, unsigned long first, block_run_t *run,
+                                 unsigned long *released) {
+    extent_t *extent = NULL;
+    unsigned long kept = 0;
+    while (node->header.count > 0) {
+        extent = &node->extents[node->header.count - 1];
+        if (node->header.depth > 0) {
+            extent_truncate_node(EXTENT_BLOCK(extent->start), first, run, released);
+            // the entries left below it are all before first, and so is everything before it
+            if (EXTENT_BLOCK(extent->start)->header.count > 0)
+                break;
+            add_block_to_run(run, extent->start, released);
+        } else if (extent->logical + extent->length <= first) {
+            break;
+        } else if (extent->logical < first) {
+            kept = first - extent->logical;
+            release_block_range(extent->start + kept, extent->length - kept);
+            *released += extent->length - kept;
+            extent->length = kept;
+            break;
         } else {
-            printk(KERN_ERR "Encountered unexpected case in extend_inode\n");
+            release_block_range(extent->start, extent->length);
+            *released += extent->length;
+        }
+        memset(extent, 0, EXTENT_SIZE);
+        node->header.count--;
+    }
+}
+
+/*
+ *  Links a new data block to the end of inode and returns it, or NULL on error.
+ *  Blocks, including any indirect blocks needed, are taken from res when it is
+ *  not NULL. To be called with write lock held!
+ */
+static void *extend_inode(index_node_t *inode, block_reservation_t *res) {
+    void *preallocated_block = NULL;
+    if (inode->size >= MAX_FILE_SIZE - BLOCK_SIZE + 1) {
+        // there's no room for another block for this file
+        return NULL;
+    }
+    preallocated_block = lookup_block(inode, inode->size / BLOCK_SIZE);
+    if (preallocated_block != NULL)
+        return preallocated_block;
+    return allocate_file_block(inode, inode->size / BLOCK_SIZE, res);
+}
+
+/*
+ *  Maps a zeroed data block at every hole among file blocks first to last of
+ *  inode, reserving them up front in as few runs as possible. Returns 0, or
+ *  -ENOSPC with the blocks mapped so far left in place. To be called with
+ *  write lock held.
+ */
+static int preallocate_blocks(index_node_t *inode, unsigned long first, unsigned long last) {
+    block_reservation_t res;
+    unsigned long block_index = 0, holes = 0, indirect = 0;
+    int ret = 0;
+    for (block_index = first; block_index <= last; block_index++)
+        if (lookup_block_num(inode, block_index) == 0)
+            holes++;
+    if (holes == 0)
+        return 0;
+    // the indirect blocks the range would need if it was all holes
+    indirect = count_mapped_blocks(inode, (loff_t) (last + 1) * BLOCK_SIZE) -
+               count_mapped_blocks(inode, (loff_t) first * BLOCK_SIZE) - (last + 1 - first);
+    reserve_data_blocks(&res, holes + indirect, next_block_goal(inode, first));
+    for (block_index = first; block_index <= last && ret == 0; block_index++)
+        if (lookup_block_num(inode, block_index) == 0 && allocate_file_block(inode, block_index, &res) == NULL)
+            ret = -ENOSPC;
+    release_reserved_data_blocks(&res);
+    return ret;
+}
+
+/*
+ *  Maps a new zeroed data block at file block block_index of inode, which
+ *  must be a hole, and returns it, or NULL on error. Blocks are taken from
+ *  res like in extend_inode. To be called with write lock held.
+ */
+static void *allocate_file_block(index_node_t *inode, unsigned long block_index, block_reservation_t *res) {
+    void *new_block;
+    unsigned long block_num;
+    // right after the block of the previous file block if possible
+    new_block = get_reserved_data_block(res, next_block_goal(inode, block_index));
+    if (new_block == NULL)
+        return NULL;
+    block_num = block_number(new_block);
+    // indirect blocks go right after the data block they are created for
+    if (map_block(inode, block_index, block_num, res, block_num + 1) != 0) {
+        release_data_block(block_num);
+        return NULL;
+    }
+    return new_block;
+}
+
+/*
+ *  Moves the inline data of inode into a data block of its own, so that the
+ *  file can grow past INLINE_DATA_SIZE. Returns 0, or -ENOSPC if no block is
+ *  available. To be called with write lock held.
+ */
+static int promote_inline_data(index_node_t *inode) {
+    void *block = NULL;
+    if (!(inode->flags & INODE_INLINE))
+        return 0;
+    if (inode->size > 0) {
+        block = get_free_data_block(next_block_goal(inode, 0));
+        if (block == NULL)
+            return -ENOSPC;
+        memcpy(block, INLINE_DATA(inode), inode->size);
+    }
+    // an all zero pointer area is an empty block map, and an empty extent tree
+    memset(INLINE_DATA(inode), 0, INLINE_DATA_SIZE);
+    inode->flags &= ~INODE_INLINE;
+    if (block != NULL)
+        map_block(inode, 0, block_number(block), NULL, NO_BLOCK);
+    return 0;
+}
+
+/*
+ *  Sets the size of the regular file inode to size. Shrinking releases every
+ *  block past the new EOF, those rd_fallocate mapped there included, and
+ *  zeroes the rest of the new last block, growing leaves a hole. Returns 0,
+ *  -EINVAL for a directory, or -ENOSPC if inline data has to move to a block
+ *  and there is none. To be called with write lock held.
+ */
+static int truncate_inode(index_node_t *inode, loff_t size) {
+    unsigned long tail = size % BLOCK_SIZE;
+    void *block = NULL;
+    int ret = 0;
+    if (inode->type != REG)
+        return -EINVAL;
+    if (inode->flags & INODE_INLINE) {
+        // inline bytes past EOF are kept zero
+        if (size < inode->size)
+            memset(INLINE_DATA(inode) + size, 0, inode->size - size);
+        else if (size > INLINE_DATA_SIZE && (ret = promote_inline_data(inode)) != 0)
+            return ret;
+    } else if (size == 0) {
+        truncate_blocks(inode, 0);
+        // an empty file goes back to storing its data inline
+        memset(INLINE_DATA(inode), 0, INLINE_DATA_SIZE);
+        inode->flags |= INODE_INLINE;
+    } else if (size < inode->size) {
+        truncate_blocks(inode, DIV_ROUND_UP(size, BLOCK_SIZE));
+        // the last block keeps its bytes past EOF zero for a later grow or hole
+        if (tail != 0 && (block = lookup_block(inode, size / BLOCK_SIZE)) != NULL)
+            memset(block + tail, 0, BLOCK_SIZE - tail);
+    }
+    inode->size = size;
+    return 0;
+}
+
+/*
+ *  Returns the slot for a new entry at the end of directory dir, adding a
+ *  block or promoting an inline directory as needed, or NULL if dir can't
+ *  grow. The caller fills in the entry and updates dir->size.
+ *  To be called with write lock held.
+ */
+static directory_entry_t *append_directory_entry(index_node_t *dir) {
+    if (dir->flags & INODE_INLINE) {
+        if (dir->size + DIR_ENTRY_SIZE <= INLINE_DATA_SIZE)
+            return (directory_entry_t *) (INLINE_DATA(dir) + dir->size);
+        if (promote_inline_data(dir) != 0)
             return NULL;
+    }
+    if (dir->size % BLOCK_SIZE == 0)
+        return (directory_entry_t *) extend_inode(dir, NULL);
+    return get_directory_entry(dir, dir->size / DIR_ENTRY_SIZE - 1) + 1;
+}
+
+/*
+ *  Returns the number of data and indirect blocks needed to map size bytes of
+ *  inode. Extent tree blocks depend on how fragmented the file is, so only
+ *  data blocks are counted for an INODE_EXTENTS inode.
+ */
+static unsigned long count_mapped_blocks(index_node_t *inode, loff_t size) {
+    unsigned long data_blocks_needed = DIV_ROUND_UP(size, BLOCK_SIZE), total = data_blocks_needed;
+    unsigned long left = 0, in_tree = 0, span = 1, level_span = 0;
+    int depth = 0, level = 0;
+    if (data_blocks_needed <= DIRECT || (inode->flags & INODE_EXTENTS))
+        return total;
+    left = data_blocks_needed - DIRECT;
+    for (depth = 1; depth <= INDIRECT_LEVELS && left > 0; depth++) {
+        span *= POINTER_PER_BLOCK;
+        in_tree = min(left, span);
+        // every level of the tree needs one indirect block per POINTER_PER_BLOCK blocks of the level below
+        level_span = 1;
+        for (level = 0; level < depth; level++) {
+            level_span *= POINTER_PER_BLOCK;
+            total += DIV_ROUND_UP(in_tree, level_span);
         }
+        left -= in_tree;
     }
-    return extending_block;
+    return total;
 }
 
 // to be called with readlock held
@@ -512,52 +1212,909 @@ static directory_entry_t *get_directory_entry(index_node_t *inode, int index) {
     if (inode->type != DIR || inode->size / DIR_ENTRY_SIZE <= index) {
         return NULL;
     }
+    if (inode->flags & INODE_INLINE)
+        return (directory_entry_t *) INLINE_DATA(inode) + index;
     return (directory_entry_t *) get_byte_address(inode, index * sizeof(directory_entry_t));
 }
 
 
-// returns a pointer to a free data block, or NULL if one is not available
-static void *get_free_data_block() {
-    unsigned long block_num = 0;
+/*
+ *  Takes up to wanted from the free count in counter without ever letting it
+ *  drop below zero, so concurrent allocators can't over-allocate.
+ *  Returns how many were taken.
+ */
+static long take_free_count(atomic_long_t *counter, long wanted) {
+    long free = atomic_long_read(counter), taken = 0, old = 0;
+    while (free > 0) {
+        taken = min(free, wanted);
+        old = atomic_long_cmpxchg(counter, free, free - taken);
+        if (old == free)
+            return taken;
+        free = old;
+    }
+    return 0;
+}
+
+/*
+ *  Marks block_num used in the block bitmap and its group summary.
+ *  Returns false if another cpu claimed it first. A block must only be
+ *  claimed after its free count was taken with take_free_count.
+ */
+static bool claim_block_bit(unsigned long block_num) {
+    unsigned long group = block_num / BLOCK_GROUP_SIZE;
+    if (test_and_set_bit(block_num, block_bitmap))
+        return false;
+    if (atomic_dec_return(&block_group_free[group]) == 0) {
+        clear_bit(group, block_group_summary);
+        smp_mb();
+        // a block of the group may have been released since the decrement
+        if (atomic_read(&block_group_free[group]) > 0)
+            set_bit(group, block_group_summary);
+    }
+    return true;
+}
+
+/*
+ *  Marks block_num free in the block bitmap and its group summary. The free
+ *  count must only be given back after the bit is cleared.
+ */
+static void release_block_bit(unsigned long block_num) {
+    unsigned long group = block_num / BLOCK_GROUP_SIZE;
+    clear_bit(block_num, block_bitmap);
+    smp_mb();
+    if (atomic_inc_return(&block_group_free[group]) == 1)
+        set_bit(group, block_group_summary);
+}
+
+/*
+ *  Returns the first free block at or after block_num, or NO_BLOCK if there
+ *  is none. Full groups are skipped through the summary bitmap, so at most one
+ *  bitmap word is searched per group that has a free block. The result is
+ *  only a candidate, it has to be claimed with claim_block_bit.
+ */
+static unsigned long find_free_block(unsigned long block_num) {
+    unsigned long group = block_num / BLOCK_GROUP_SIZE, group_end = 0, found = 0;
+    if (group < num_block_groups && !test_bit(group, block_group_summary))
+        group = find_next_bit(block_group_summary, num_block_groups, group + 1);
+    while (group < num_block_groups) {
+        group_end = (group + 1) * BLOCK_GROUP_SIZE;
+        found = find_next_zero_bit(block_bitmap, group_end, max(block_num, group * BLOCK_GROUP_SIZE));
+        if (found < group_end)
+            return found;
+        group = find_next_bit(block_group_summary, num_block_groups, group + 1);
+    }
+    return NO_BLOCK;
+}
+
+// Like find_free_block, but wraps around to block 0
+static unsigned long find_free_block_wrap(unsigned long block_num) {
+    unsigned long found = find_free_block(block_num);
+    if (found == NO_BLOCK && block_num > 0)
+        found = find_free_block(0);
+    return found;
+}
+
+// Returns the block number of the data block at block_address, using the page's slot in chunk_pages
+static unsigned long block_number(void *block_address) {
+    unsigned long slot = page_private(virt_to_page(block_address));
+    return slot / PAGES_PER_CHUNK * BLOCK_GROUP_SIZE +
+           ((slot % PAGES_PER_CHUNK) * PAGE_SIZE + ((unsigned long) block_address & ~PAGE_MASK)) / BLOCK_SIZE;
+}
+
+// Returns the address of block block_num, whose chunk must be backed
+static void *data_block_address(unsigned long block_num) {
+    unsigned long offset = (block_num % BLOCK_GROUP_SIZE) * BLOCK_SIZE;
+    return chunk_pages[block_num / BLOCK_GROUP_SIZE * PAGES_PER_CHUNK + offset / PAGE_SIZE] + offset % PAGE_SIZE;
+}
+
+/*
+ *  Backs chunk with zeroed pages, unless another cpu beats us to it, and
+ *  returns the address of its first page, or NULL if no memory is available.
+ *  Every page remembers its slot in chunk_pages for block_number. Callers
+ *  hold a claim on a block of the chunk, which keeps the shrinker away from it.
+ */
+static void *populate_chunk(unsigned long chunk) {
+    void *pages[PAGES_PER_CHUNK], **slots = &chunk_pages[chunk * PAGES_PER_CHUNK];
+    struct page *page = NULL;
+    bool installed = false;
+    long zeroed = 0;
+    int i = 0;
+    // called from allocation paths that hold inode spinlocks, so only single pages, which fragmentation
+    // can't make unavailable; falls back to other nodes if the pool's node is full
+    for (i = 0; i < PAGES_PER_CHUNK; i++) {
+        page = alloc_pages_node(chunk_node[chunk], GFP_ATOMIC | __GFP_ZERO | __GFP_NOWARN, 0);
+        if (page == NULL) {
+            free_chunk(pages, i);
+            atomic_long_inc(&chunk_alloc_failures);
+            return NULL;
+        }
+        set_page_private(page, chunk * PAGES_PER_CHUNK + i);
+        pages[i] = page_address(page);
+    }
+    spin_lock(&chunk_install_spinlock);
+    if (slots[0] == NULL) {
+        // the chunk's known zero blocks join the reservoir; none of their bits can be cleared before it's backed
+        for (i = 0; i < BLOCK_GROUP_SIZE; i++)
+            if (test_bit(chunk * BLOCK_GROUP_SIZE + i, block_zeroed))
+                zeroed++;
+        atomic_long_add(zeroed, &zeroed_free_blocks);
+        // the first page marks the chunk backed, so it goes in last
+        for (i = 1; i < PAGES_PER_CHUNK; i++)
+            slots[i] = pages[i];
+        smp_wmb();
+        slots[0] = pages[0];
+        installed = true;
+    }
+    spin_unlock(&chunk_install_spinlock);
+    if (!installed) {
+        free_chunk(pages, PAGES_PER_CHUNK);
+        return slots[0];
+    }
+    atomic_long_inc(&populated_chunks);
+    return pages[0];
+}
+
+/*
+ *  Allocates the super block, inode table and bitmap, which every lookup
+ *  goes through. They come from the direct mapping when the allocator has
+ *  enough contiguous pages, so they are covered by its large page entries
+ *  rather than by 4 KB vmalloc mappings, and from vmalloc otherwise or with
+ *  rd_vmalloc_metadata.
+ */
+static void *alloc_metadata(unsigned long size) {
+    void *metadata = NULL;
+    int order = get_order(size);
+    metadata_order = -1;
+    if (!rd_vmalloc_metadata && order < MAX_ORDER) {
+        metadata = (void *) __get_free_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, order);
+        if (metadata != NULL) {
+            metadata_order = order;
+            return metadata;
+        }
+    }
+    return vmalloc(size);
+}
+
+// Gives the first count pages of a chunk back to the system and clears their slots in pages
+static void free_chunk(void **pages, int count) {
+    struct page *page = NULL;
+    int i = 0;
+    for (i = 0; i < count; i++) {
+        page = virt_to_page(pages[i]);
+        set_page_private(page, 0);
+        __free_page(page);
+        pages[i] = NULL;
+    }
+}
+
+/*
+ *  Frees the pages behind chunk if none of its blocks are allocated or cached
+ *  in a magazine. Every block of the chunk is claimed from the bitmap while
+ *  the pages go away, so that no allocator can hand one of them out halfway.
+ *  Returns true if the chunk was freed.
+ */
+static bool release_empty_chunk(unsigned long chunk) {
+    unsigned long start = chunk * BLOCK_GROUP_SIZE, claimed = 0, newly_zeroed = 0, i = 0;
+    long taken = 0;
+    void *pages[PAGES_PER_CHUNK];
+    if (!CHUNK_BACKED(chunk) || atomic_read(&block_group_free[chunk]) != BLOCK_GROUP_SIZE)
+        return false;
+    // take the blocks off the free count first, like any other allocation
+    taken = take_free_count(&super_block->num_free_blocks, BLOCK_GROUP_SIZE);
+    if (taken < BLOCK_GROUP_SIZE) {
+        atomic_long_add(taken, &super_block->num_free_blocks);
+        return false;
+    }
+    while (claimed < BLOCK_GROUP_SIZE && claim_block_bit(start + claimed))
+        claimed++;
+    if (claimed < BLOCK_GROUP_SIZE || !CHUNK_BACKED(chunk)) {
+        release_block_range(start, claimed);
+        atomic_long_add(BLOCK_GROUP_SIZE, &super_block->num_free_blocks);
+        return false;
+    }
+    // the blocks leave the reservoir with their pages and are known zero again once the chunk is backed anew
+    for (i = start; i < start + BLOCK_GROUP_SIZE; i++)
+        if (!test_and_set_bit(i, block_zeroed))
+            newly_zeroed++;
+    atomic_long_sub(BLOCK_GROUP_SIZE - newly_zeroed, &zeroed_free_blocks);
+    memcpy(pages, &chunk_pages[chunk * PAGES_PER_CHUNK], sizeof(pages));
+    chunk_pages[chunk * PAGES_PER_CHUNK] = NULL;
+    smp_mb();
+    free_chunk(pages, PAGES_PER_CHUNK);
+    memset(&chunk_pages[chunk * PAGES_PER_CHUNK], 0, sizeof(pages));
+    atomic_long_dec(&populated_chunks);
+    atomic_long_inc(&chunks_released);
+    release_data_extent(start, BLOCK_GROUP_SIZE);
+    return true;
+}
+
+// Frees up to nr_to_release empty chunks and returns how many were freed
+static unsigned long release_empty_chunks(unsigned long nr_to_release) {
+    unsigned long chunk = 0, released = 0;
+    for (chunk = 0; chunk < num_block_groups && released < nr_to_release; chunk++)
+        if (release_empty_chunk(chunk))
+            released++;
+    return released;
+}
+
+// Returns the number of backed chunks without an allocated block, racy and only an estimate
+static unsigned long count_empty_chunks(void) {
+    unsigned long chunk = 0, empty = 0;
+    for (chunk = 0; chunk < num_block_groups; chunk++)
+        if (CHUNK_BACKED(chunk) && atomic_read(&block_group_free[chunk]) == BLOCK_GROUP_SIZE)
+            empty++;
+    return empty;
+}
+
+/*
+ *  Memory shrinker callback, counting in chunks. Frees up to nr_to_scan empty
+ *  chunks and returns the number of empty chunks left.
+ */
+static int rd_shrink(int nr_to_scan, gfp_t gfp_mask) {
+    if (!rd_initialized())
+        return 0;
+    if (nr_to_scan > 0)
+        release_empty_chunks(nr_to_scan);
+    return min_t(unsigned long, count_empty_chunks(), INT_MAX);
+}
+
+/*
+ *  Returns where file block block_index of inode should go: just past the
+ *  data block of the file block before it, as long as that is mapped and in
+ *  the pool of the file's home node, or of the writing cpu's node if it has
+ *  none. Otherwise it is the first free block of that pool. Once the pool is
+ *  full the file keeps growing contiguously wherever it spilled to. Returns
+ *  NO_BLOCK if no block looks free. To be called with a lock on inode held.
+ */
+static unsigned long next_block_goal(index_node_t *inode, unsigned long block_index) {
+    unsigned long goal = NO_BLOCK, pool_goal = 0;
+    block_num_t prev = 0;
+    int node = inode->home_node != NO_HOME_NODE ? inode->home_node : numa_node_id();
+    if (block_index > 0 && !(inode->flags & INODE_INLINE))
+        prev = lookup_block_num(inode, block_index - 1);
+    if (prev != 0)
+        goal = prev + 1;
+    if (goal < num_data_blocks && chunk_node[goal / BLOCK_GROUP_SIZE] == node)
+        return goal;
+    pool_goal = node_block_goal(node);
+    if (goal < num_data_blocks && pool_goal != NO_BLOCK && chunk_node[pool_goal / BLOCK_GROUP_SIZE] != node)
+        return goal;
+    return pool_goal;
+}
+
+// Returns the first free block of node's pool at or after its rotor, or of the pools after it if it is full
+static unsigned long node_block_goal(int node) {
+    return find_free_block_wrap(node_rotor[node]);
+}
+
+/*
+ *  Splits the block groups into one pool per online node, in node order, and
+ *  starts every pool's rotor at its first block. To be called from rd_init.
+ */
+static void split_node_pools(void) {
+    unsigned long group = 0;
+    int node = 0, pool = 0, pools = num_online_nodes();
+    for (node = 0; node < nr_node_ids; node++) {
+        pool_start[node] = num_block_groups * pool / pools;
+        node_rotor[node] = pool_start[node] * BLOCK_GROUP_SIZE;
+        if (node_online(node))
+            pool++;
+    }
+    pool_start[nr_node_ids] = num_block_groups;
+    for (node = 0; node < nr_node_ids; node++)
+        for (group = pool_start[node]; group < pool_start[node + 1]; group++)
+            chunk_node[group] = node;
+}
+
+/*
+ *  Counts a copy to or from the data block at block_address as a local or
+ *  remote access of a cpu on node. Inline data lives in the inode table and
+ *  isn't counted.
+ */
+static void count_block_access(node_stats_t *stats, int node, void *block_address) {
+    if (page_to_nid(virt_to_page(block_address)) == node)
+        stats->local_accesses++;
+    else
+        stats->remote_accesses++;
+}
+
+/*
+ *  Recomputes the group free counts and summary bitmap from block_bitmap.
+ *  Bits past the last data block are marked used so no search can return them.
+ *  To be called before the ramdisk is in use.
+ */
+static void rebuild_block_group_index(void) {
+    unsigned long group = 0, block_num = 0, group_end = 0;
+    int group_free = 0;
+    for (block_num = num_data_blocks; block_num < num_block_groups * BLOCK_GROUP_SIZE; block_num++)
+        set_bit(block_num, block_bitmap);
+    // block number 0 means "no block" in block maps, so it is never handed out
+    set_bit(0, block_bitmap);
+    memset(block_group_summary, 0, BITS_TO_LONGS(num_block_groups) * sizeof(unsigned long));
+    for (group = 0; group < num_block_groups; group++) {
+        group_free = 0;
+        group_end = (group + 1) * BLOCK_GROUP_SIZE;
+        for (block_num = group * BLOCK_GROUP_SIZE; block_num < group_end; block_num++)
+            if (!test_bit(block_num, block_bitmap))
+                group_free++;
+        atomic_set(&block_group_free[group], group_free);
+        if (group_free > 0)
+            set_bit(group, block_group_summary);
+    }
+}
+
+/*
+ *  Moves up to MAGAZINE_BATCH free blocks from the block bitmap into mag,
+ *  taking the first free blocks at or after goal, or after the rotor of this
+ *  cpu's node pool if there is no goal. The lowest block ends up on top of the magazine.
+ *  Returns the number of blocks in mag. To be called with mag->lock held and
+ *  at least MAGAZINE_BATCH free slots in mag.
+ */
+static int magazine_refill(block_magazine_t *mag, unsigned long goal) {
+    int wanted = 0, found = 0, wraps = 0, node = numa_node_id();
+    unsigned long block_num = 0, prev = 0, found_blocks[MAGAZINE_BATCH];
+    wanted = take_free_blocks(MAGAZINE_BATCH);
+    if (wanted == 0)
+        return 0;
+    block_num = find_free_block_wrap(goal != NO_BLOCK ? goal : node_rotor[node]);
+    // every block we took a count for has a free bit, but other cpus may beat us to any given one
+    while (found < wanted && block_num != NO_BLOCK && wraps < 2) {
+        if (claim_block_bit(block_num))
+            found_blocks[found++] = block_num;
+        prev = block_num;
+        block_num = find_free_block_wrap(block_num + 1);
+        if (block_num <= prev)
+            wraps++;
+    }
+    if (goal == NO_BLOCK && found > 0)
+        node_rotor[node] = found_blocks[found - 1] + 1;
+    if (found < wanted) {
+        // the counter and the bitmap disagree, give back what we didn't get
+        printk(KERN_ERR "Block bitmap has fewer free blocks than the super block claims\n");
+        atomic_long_add(wanted - found, &super_block->num_free_blocks);
+    }
+    // stack the blocks so that they are popped in ascending order
+    while (found > 0)
+        mag->blocks[mag->count++] = found_blocks[--found];
+    mag->refills++;
+    return mag->count;
+}
+
+/*
+ *  Returns the oldest MAGAZINE_BATCH blocks of mag to the block bitmap.
+ *  To be called with mag->lock held.
+ */
+static void magazine_drain(block_magazine_t *mag) {
+    int i = 0;
+    for (i = 0; i < MAGAZINE_BATCH; i++)
+        release_block_bit(mag->blocks[i]);
+    atomic_long_add(MAGAZINE_BATCH, &super_block->num_free_blocks);
+    mag->count -= MAGAZINE_BATCH;
+    memmove(mag->blocks, mag->blocks + MAGAZINE_BATCH, mag->count * sizeof(unsigned long));
+    mag->drains++;
+}
+/*
+ *  Takes one block out of another cpu's magazine. Used when the bitmap is
+ *  exhausted but blocks are still cached elsewhere. Returns the block number,
+ *  or NO_BLOCK if every magazine is empty. Must not be called with any
+ *  magazine lock held.
+ */
+static unsigned long magazine_steal(void) {
+    int cpu = 0;
+    unsigned long block_num = NO_BLOCK;
+    block_magazine_t *mag = NULL;
+    for_each_possible_cpu(cpu) {
+        mag = &per_cpu(block_magazines, cpu);
+        spin_lock(&mag->lock);
+        if (mag->count > 0) {
+            block_num = mag->blocks[--mag->count];
+            mag->steals++;
+        }
+        spin_unlock(&mag->lock);
+        if (block_num != NO_BLOCK)
+            break;
+    }
+    return block_num;
+}
+
+// returns the number of free blocks currently cached in the per-cpu magazines
+static int magazine_cached_blocks(void) {
+    int cpu = 0, cached = 0;
+    for_each_possible_cpu(cpu)
+        cached += per_cpu(block_magazines, cpu).count;
+    return cached;
+}
+
+/*
+ *  Returns a pointer to a free data block, or NULL if one is not available.
+ *  goal is the block the caller would like, e.g. the one following the file's
+ *  last block, or NO_BLOCK. If the top of this cpu's magazine isn't the goal
+ *  but the goal looks free, the magazine is refilled starting at the goal so
+ *  that following allocations with consecutive goals are magazine hits.
+ */
+static void *get_free_data_block(unsigned long goal) {
+    unsigned long block_num = NO_BLOCK;
     void *block_address = NULL;
-    spin_lock(&super_block_spinlock);
-    if (super_block->num_free_blocks == 0) {
-        spin_unlock(&super_block_spinlock);
+    block_magazine_t *mag = &get_cpu_var(block_magazines);
+    spin_lock(&mag->lock);
+    if (mag->count > 0 && (goal == NO_BLOCK || mag->blocks[mag->count - 1] == goal)) {
+        mag->hits++;
+    } else if (goal != NO_BLOCK && !test_bit(goal, block_bitmap)) {
+        // only a peek, refill claims whatever is still free when it gets there
+        mag->misses++;
+        if (mag->count > MAGAZINE_SIZE - MAGAZINE_BATCH)
+            magazine_drain(mag);
+        magazine_refill(mag, goal);
+    } else if (mag->count > 0) {
+        mag->hits++;
+    } else {
+        mag->misses++;
+        magazine_refill(mag, goal);
+    }
+    if (mag->count > 0)
+        block_num = mag->blocks[--mag->count];
+    spin_unlock(&mag->lock);
+    put_cpu_var(block_magazines);
+    if (block_num == NO_BLOCK)
+        block_num = magazine_steal();
+    if (block_num == NO_BLOCK)
         return NULL;
+    return prepare_data_block(block_num);
+}
+
+/*
+ *  Frees the data block block_num to be re-allocated. Block 0 means
+ *  no block. NEVER CALL THIS FUNCTION while holding a magazine lock!
+ */
+static void release_data_block(block_num_t block_num) {
+    block_magazine_t *mag = NULL;
+    if (block_num == 0) {
+        return;
+    }
+    mag = &get_cpu_var(block_magazines);
+    spin_lock(&mag->lock);
+    if (mag->count == MAGAZINE_SIZE)
+        magazine_drain(mag);
+    mag->blocks[mag->count++] = block_num;
+    spin_unlock(&mag->lock);
+    put_cpu_var(block_magazines);
+    return;
+}
+
+/*
+ *  Reserves up to wanted contiguous free blocks with a single bitmap scan that
+ *  starts at goal, or at the rotor of this cpu's node pool if there is no goal, and wraps
+ *  around. If no free run is long enough, the largest run found is reserved
+ *  instead. Stores the first block number of the run in start and returns
+ *  its length, 0 if the bitmap has no free blocks left.
+ */
+static unsigned long get_free_data_extent(unsigned long wanted, unsigned long goal, unsigned long *start) {
+    unsigned long run_start = 0, run_end = 0, best_start = 0, best_len = 0, claimed = 0, search_from = 0;
+    int attempts = 0, node = numa_node_id();
+    bool wrapped = false;
+    wanted = take_free_blocks(min_t(unsigned long, wanted, LONG_MAX));
+    if (wanted == 0)
+        return 0;
+    search_from = goal != NO_BLOCK ? goal : node_rotor[node];
+    // another cpu may claim part of the run we picked between the scan and our claims
+    for (attempts = 0; attempts < 3 && claimed == 0; attempts++) {
+        best_len = 0;
+        wrapped = false;
+        run_start = find_free_block(search_from);
+        while (true) {
+            if (run_start == NO_BLOCK) {
+                if (wrapped || search_from == 0)
+                    break;
+                wrapped = true;
+                run_start = find_free_block(0);
+                continue;
+            }
+            if (wrapped && run_start >= search_from)
+                break;
+            // no need to measure a run past the length we are looking for
+            run_end = find_next_bit(block_bitmap, min(num_data_blocks, run_start + wanted), run_start);
+            if (run_end - run_start > best_len) {
+                best_start = run_start;
+                best_len = run_end - run_start;
+                if (best_len >= wanted)
+                    break;
+            }
+            run_start = find_free_block(run_end);
+        }
+        best_len = min(best_len, wanted);
+        if (best_len == 0)
+            break;
+        // keep the prefix of the run we managed to claim
+        while (claimed < best_len && claim_block_bit(best_start + claimed))
+            claimed++;
+    }
+    if (goal == NO_BLOCK && claimed > 0)
+        node_rotor[node] = best_start + claimed;
+    if (claimed < wanted)
+        atomic_long_add(wanted - claimed, &super_block->num_free_blocks);
+    *start = best_start;
+    return claimed;
+}
+
+/*
+ *  Takes up to wanted blocks off the free block count. Runs under magazine
+ *  and inode spinlocks, so it never frees the blocks of unlinked files itself;
+ *  writers call wait_for_reclaim before taking their locks instead.
+ */
+static long take_free_blocks(long wanted) {
+    return take_free_count(&super_block->num_free_blocks, wanted);
+}
+
+/*
+ *  Waits for the reclaim worker if unlinked files still hold blocks and the
+ *  free count looks too low for writing bytes. Only a hint: the allocation
+ *  still fails cleanly if the blocks don't turn up. May sleep, so call it
+ *  before taking any spinlock.
+ */
+static void wait_for_reclaim(unsigned long bytes) {
+    if (atomic_long_read(&pending_reclaim_blocks) > 0 &&
+        atomic_long_read(&super_block->num_free_blocks) <= (long) (bytes / BLOCK_SIZE))
+        flush_work(&reclaim_work);
+}
+
+/*
+ *  Marks count contiguous blocks starting at start free in the bitmap, updating
+ *  each group's free count once. The caller gives the blocks back to
+ *  num_free_blocks afterwards.
+ */
+static void release_block_range(unsigned long start, unsigned long count) {
+    unsigned long end = start + count, group = 0, group_end = 0, block_num = 0;
+    while (start < end) {
+        group = start / BLOCK_GROUP_SIZE;
+        group_end = min(end, (group + 1) * BLOCK_GROUP_SIZE);
+        for (block_num = start; block_num < group_end; block_num++)
+            clear_bit(block_num, block_bitmap);
+        smp_mb();
+        if (atomic_add_return(group_end - start, &block_group_free[group]) == group_end - start)
+            set_bit(group, block_group_summary);
+        start = group_end;
+    }
+}
+
+// Returns count contiguous blocks starting at block number start to the bitmap
+static void release_data_extent(unsigned long start, unsigned long count) {
+    if (count == 0)
+        return;
+    release_block_range(start, count);
+    atomic_long_add(count, &super_block->num_free_blocks);
+}
+
+/*
+ *  Appends block_num to run, releasing the run first if block_num doesn't
+ *  extend it. released counts every block released so far.
+ */
+static void add_block_to_run(block_run_t *run, unsigned long block_num, unsigned long *released) {
+    // a hole in a sparse file
+    if (block_num == 0)
+        return;
+    if (run->count > 0 && block_num == run->start + run->count) {
+        run->count++;
+        return;
+    }
+    release_block_range(run->start, run->count);
+    *released += run->count;
+    run->start = block_num;
+    run->count = 1;
+}
+
+/*
+ *  Adds the data blocks under block node, a tree depth levels deep, to run in
+ *  file order, up to data_blocks_left of them, followed by node itself.
+ *  Holes are counted off data_blocks_left but not released.
+ */
+static void add_tree_to_run(block_num_t node, int depth, unsigned long *data_blocks_left, block_run_t *run,
+                            unsigned long *released) {
+    indirect_block_t *indirect_block = NULL;
+    unsigned long span = 1;
+    int i = 0;
+    if (node == 0) {
+        // a hole spanning the whole tree
+        for (i = 0; i < depth; i++)
+            span *= POINTER_PER_BLOCK;
+        *data_blocks_left -= min(*data_blocks_left, span);
+        return;
+    }
+    indirect_block = INDIRECT_BLOCK(node);
+    for (i = 0; i < POINTER_PER_BLOCK && *data_blocks_left > 0; i++) {
+        if (depth == 1) {
+            add_block_to_run(run, indirect_block->data[i], released);
+            (*data_blocks_left)--;
+        } else {
+            add_tree_to_run(indirect_block->data[i], depth - 1, data_blocks_left, run, released);
+        }
     }
-    super_block->num_free_blocks--;
-    spin_unlock(&super_block_spinlock);
-    spin_lock(&block_bitmap_spinlock);
-    block_num = find_first_zero_bit(block_bitmap, BLOCK_BITMAPS * BLOCK_SIZE * 8);
-    if (block_num == BLOCK_BITMAPS * BLOCK_SIZE * 8) {
-        spin_unlock(&block_bitmap_spinlock);
+    add_block_to_run(run, node, released);
+}
+
+/*
+ *  Releases the extents under node, a whole extent at a time, and adds the
+ *  tree blocks below it to run once their entries have been read.
+ */
+static void add_extent_tree_to_run(extent_node_t *node, block_run_t *run, unsigned long *released) {
+    int i = 0;
+    for (i = 0; i < node->header.count; i++) {
+        if (node->header.depth > 0) {
+            add_extent_tree_to_run(EXTENT_BLOCK(node->extents[i].start), run, released);
+            add_block_to_run(run, node->extents[i].start, released);
+        } else {
+            release_block_range(node->extents[i].start, node->extents[i].length);
+            *released += node->extents[i].length;
+        }
+    }
+}
+
+/*
+ *  Releases every data and indirect block mapped by mapping to the bitmap,
+ *  coalescing consecutive block numbers into range releases. Returns the
+ *  number of blocks released, which the caller adds to num_free_blocks.
+ */
+static unsigned long release_mapped_blocks(index_node_t *mapping) {
+    // rd_fallocate can map blocks past EOF, so the whole map is walked and the holes skipped
+    unsigned long released = 0, data_blocks_left = ULONG_MAX, i = 0;
+    block_run_t run = {.start = 0, .count = 0};
+    if (mapping->flags & INODE_EXTENTS) {
+        add_extent_tree_to_run(EXTENT_ROOT(mapping), &run, &released);
+        release_block_range(run.start, run.count);
+        return released + run.count;
+    }
+    for (i = 0; i < DIRECT && data_blocks_left > 0; i++, data_blocks_left--)
+        add_block_to_run(&run, mapping->direct[i], &released);
+    for (i = 0; i < INDIRECT_LEVELS && data_blocks_left > 0; i++)
+        add_tree_to_run(mapping->indirect[i], i + 1, &data_blocks_left, &run, &released);
+    release_block_range(run.start, run.count);
+    return released + run.count;
+}
+
+/*
+ *  Detaches the block tree of inode and queues it for reclaim_work, so that
+ *  unlinking a big file doesn't free its blocks one at a time with the parent
+ *  directory locked. The caller resets the inode's pointers afterwards.
+ *  To be called with write lock on inode held.
+ */
+static void defer_block_reclaim(index_node_t *inode) {
+    reclaim_request_t *req = NULL;
+    if (inode->flags & INODE_INLINE)
+        return;
+    req = (reclaim_request_t *) kmalloc(sizeof(reclaim_request_t), GFP_ATOMIC);
+    if (req == NULL) {
+        // can't queue it, free the blocks right away
+        atomic_long_add(release_mapped_blocks(inode), &super_block->num_free_blocks);
+        return;
+    }
+    req->mapping = *inode;
+    // only an estimate from the size, walking the map here would hold the parent's lock for it;
+    // reclaim_pending_blocks gives back what is really there
+    req->num_blocks = max(count_mapped_blocks(inode, inode->size), 1UL);
+    atomic_long_add(req->num_blocks, &pending_reclaim_blocks);
+    spin_lock(&reclaim_list_spinlock);
+    list_add_tail(&req->list, &reclaim_list);
+    spin_unlock(&reclaim_list_spinlock);
+    queue_work(reclaim_wq, &reclaim_work);
+}
+
+/*
+ *  Frees the block trees of every queued unlinked file with one update of
+ *  num_free_blocks, which gets the blocks release_mapped_blocks actually
+ *  found. pending_reclaim_blocks drops by the estimates it was raised by.
+ */
+static void reclaim_pending_blocks(void) {
+    LIST_HEAD(batch);
+    reclaim_request_t *req = NULL, *next = NULL;
+    unsigned long released = 0, queued = 0;
+    spin_lock(&reclaim_list_spinlock);
+    list_splice_init(&reclaim_list, &batch);
+    spin_unlock(&reclaim_list_spinlock);
+    list_for_each_entry_safe(req, next, &batch, list) {
+        released += release_mapped_blocks(&req->mapping);
+        queued += req->num_blocks;
+        list_del(&req->list);
+        kfree(req);
+    }
+    if (released > 0)
+        atomic_long_add(released, &super_block->num_free_blocks);
+    atomic_long_sub(queued, &pending_reclaim_blocks);
+}
+
+// Frees the blocks of unlinked files and gives the chunks that emptied out back to the system
+static void reclaim_work_fn(struct work_struct *work) {
+    reclaim_pending_blocks();
+    release_empty_chunks(ULONG_MAX);
+}
+
+// Sets up res and reserves the first run of the wanted blocks, as close to goal as possible
+static void reserve_data_blocks(block_reservation_t *res, unsigned long wanted, unsigned long goal) {
+    res->next = 0;
+    res->count = 0;
+    res->wanted = wanted;
+    if (wanted > 0) {
+        res->count = get_free_data_extent(wanted, goal, &res->next);
+        res->wanted -= res->count;
+    }
+}
+
+/*
+ *  Returns the next zeroed block of res, reserving the largest remaining run
+ *  after the previous one when the current one is used up. Falls back to
+ *  get_free_data_block(goal) when res is NULL or the bitmap has no run left.
+ */
+static void *get_reserved_data_block(block_reservation_t *res, unsigned long goal) {
+    void *block_address = NULL;
+    if (res == NULL)
+        return get_free_data_block(goal);
+    if (res->count == 0 && res->wanted > 0) {
+        res->count = get_free_data_extent(res->wanted, res->next, &res->next);
+        res->wanted -= res->count;
+    }
+    if (res->count == 0)
+        return get_free_data_block(goal);
+    // on failure prepare_data_block has already given the block back
+    block_address = prepare_data_block(res->next);
+    res->next++;
+    res->count--;
+    return block_address;
+}
+
+// Returns the unused part of res to the bitmap
+static void release_reserved_data_blocks(block_reservation_t *res) {
+    release_data_extent(res->next, res->count);
+    res->count = 0;
+    res->wanted = 0;
+}
+
+/*
+ *  Returns the address of the newly allocated block block_num, backing its
+ *  chunk if this is the chunk's first block and zeroing it unless it is
+ *  known to be zero. Wakes zero_blocks_thread up when it had to zero the
+ *  block and the reservoir of pre-zeroed free blocks runs low. Misses are
+ *  what shows that freed, dirty blocks are being reused; a run of fresh
+ *  chunks drains the reservoir without leaving anything to zero ahead. If
+ *  the chunk can't be backed, the block goes back to the bitmap and NULL is
+ *  returned.
+ */
+static void *prepare_data_block(unsigned long block_num) {
+    void *block_address = NULL;
+    block_magazine_t *mag = NULL;
+    bool missed = false;
+    if (!CHUNK_BACKED(block_num / BLOCK_GROUP_SIZE) && populate_chunk(block_num / BLOCK_GROUP_SIZE) == NULL) {
+        release_data_extent(block_num, 1);
         return NULL;
     }
-    set_bit(block_num, block_bitmap);
-    spin_unlock(&block_bitmap_spinlock);
-    block_address = data_blocks + block_num * BLOCK_SIZE;
-    memset(block_address, 0, BLOCK_SIZE);
+    block_address = data_block_address(block_num);
+    mag = &get_cpu_var(block_magazines);
+    if (chunk_node[block_num / BLOCK_GROUP_SIZE] != numa_node_id())
+        __get_cpu_var(node_stats).remote_allocations++;
+    if (test_and_clear_bit(block_num, block_zeroed)) {
+        mag->zeroed_hits++;
+        atomic_long_dec(&zeroed_free_blocks);
+    } else {
+        mag->zeroed_misses++;
+        memset(block_address, 0, BLOCK_SIZE);
+        missed = true;
+    }
+    put_cpu_var(block_magazines);
+    if (missed && atomic_long_read(&zeroed_free_blocks) < ZERO_RESERVOIR_TARGET / 2 &&
+        waitqueue_active(&zero_blocks_wait)) {
+        zero_blocks_requested = true;
+        wake_up(&zero_blocks_wait);
+    }
     return block_address;
 }
 
 /*
- *  Frees the data block pointed to by data_block_ptr to be
- *  re-allocated. NEVER CALL THIS FUNCTION while holding
- *  super_block_spinlock OR block_bitmap_spinlock!
+ *  Keeps up to ZERO_RESERVOIR_TARGET free blocks zeroed ahead of the allocation
+ *  rotors, taking the node pools in turn, so that allocations don't have to memset their blocks on the write
+ *  path. Only freed blocks of backed chunks are dirty, so those are the ones
+ *  it zeroes. Blocks are claimed from the bitmap in runs while they are being
+ *  zeroed, so no allocator can hand them out halfway.
  */
-static void release_data_block(void *data_block_ptr) {
-    int block_num;
-    if (data_block_ptr == NULL) {
-        return;
+static int zero_blocks_thread(void *data) {
+    unsigned long start = 0, count = 0, i = 0, cursor = 0, scanned = 0;
+    int node = 0;
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(zero_blocks_wait, kthread_should_stop() || zero_blocks_requested);
+        zero_blocks_requested = false;
+        do {
+            node = (node + 1) % nr_node_ids;
+        } while (!node_online(node));
+        cursor = node_rotor[node];
+        scanned = 0;
+        // leave the last few free blocks alone so that allocators never fail on blocks we hold
+        while (!kthread_should_stop() && scanned < num_data_blocks &&
+               atomic_long_read(&zeroed_free_blocks) < ZERO_RESERVOIR_TARGET &&
+               atomic_long_read(&super_block->num_free_blocks) > 2 * ZERO_BATCH) {
+            count = get_free_data_extent(ZERO_BATCH, cursor, &start);
+            if (count == 0)
+                break;
+            for (i = start; i < start + count; i++) {
+                if (!test_bit(i, block_zeroed)) {
+                    // only blocks of backed chunks can lose their known zero bit
+                    memset(data_block_address(i), 0, BLOCK_SIZE);
+                    set_bit(i, block_zeroed);
+                    atomic_long_inc(&zeroed_free_blocks);
+                }
+            }
+            release_data_extent(start, count);
+            cursor = start + count;
+            scanned += count;
+            cond_resched();
+        }
     }
-    block_num = (data_block_ptr - data_blocks) / BLOCK_SIZE;
-    spin_lock(&super_block_spinlock);
-    super_block->num_free_blocks++;
-    spin_unlock(&super_block_spinlock);
-    spin_lock(&block_bitmap_spinlock);
-    clear_bit(block_num, block_bitmap);
-    spin_unlock(&block_bitmap_spinlock);
-    return;
+    return 0;
+}
+
+// read_proc handler for /proc/ramdisk_stats
+static int rd_stats_read_proc(char *page, char **start, off_t off, int count, int *eof, void *data) {
+    int cpu = 0, len = 0, node = 0;
+    unsigned long hits = 0, misses = 0, refills = 0, drains = 0, steals = 0, zeroed_hits = 0, zeroed_misses = 0;
+    unsigned long pool_blocks = 0, pool_free = 0, group = 0, local_accesses = 0, remote_accesses = 0,
+            remote_allocations = 0;
+    block_magazine_t *mag = NULL;
+    node_stats_t *stats = NULL;
+    if (off > 0) {
+        *eof = 1;
+        return 0;
+    }
+    for_each_possible_cpu(cpu) {
+        mag = &per_cpu(block_magazines, cpu);
+        hits += mag->hits;
+        misses += mag->misses;
+        refills += mag->refills;
+        drains += mag->drains;
+        steals += mag->steals;
+        zeroed_hits += mag->zeroed_hits;
+        zeroed_misses += mag->zeroed_misses;
+    }
+    len += sprintf(page + len, "magazine_hits %lu\n", hits);
+    len += sprintf(page + len, "magazine_misses %lu\n", misses);
+    len += sprintf(page + len, "magazine_refills %lu\n", refills);
+    len += sprintf(page + len, "magazine_drains %lu\n", drains);
+    len += sprintf(page + len, "magazine_steals %lu\n", steals);
+    len += sprintf(page + len, "zeroed_hits %lu\n", zeroed_hits);
+    len += sprintf(page + len, "zeroed_misses %lu\n", zeroed_misses);
+    len += sprintf(page + len, "zeroed_free_blocks %ld\n", atomic_long_read(&zeroed_free_blocks));
+    len += sprintf(page + len, "pending_reclaim_blocks %ld\n", atomic_long_read(&pending_reclaim_blocks));
+    if (rd_initialized()) {
+        len += sprintf(page + len, "magazine_cached_blocks %d\n", magazine_cached_blocks());
+        len += sprintf(page + len, "free_blocks %ld\n", atomic_long_read(&super_block->num_free_blocks) + magazine_cached_blocks());
+        len += sprintf(page + len, "free_inodes %ld\n", atomic_long_read(&super_block->num_free_inodes));
+        len += sprintf(page + len, "empty_chunks %lu\n", count_empty_chunks());
+    }
+    len += sprintf(page + len, "populated_chunks %ld\n", atomic_long_read(&populated_chunks));
+    len += sprintf(page + len, "chunk_alloc_failures %ld\n", atomic_long_read(&chunk_alloc_failures));
+    len += sprintf(page + len, "chunks_released %ld\n", atomic_long_read(&chunks_released));
+    len += sprintf(page + len, "metadata_direct_map %d\n", metadata_order >= 0);
+    for_each_online_node(node) {
+        if (rd_initialized()) {
+            // blocks cached in magazines count as used
+            pool_blocks = (pool_start[node + 1] - pool_start[node]) * BLOCK_GROUP_SIZE;
+            pool_free = 0;
+            for (group = pool_start[node]; group < pool_start[node + 1]; group++)
+                pool_free += atomic_read(&block_group_free[group]);
+            len += sprintf(page + len, "node%d_pool_blocks %lu\n", node, pool_blocks);
+            len += sprintf(page + len, "node%d_free_blocks %lu\n", node, pool_free);
+        }
+        local_accesses = 0;
+        remote_accesses = 0;
+        remote_allocations = 0;
+        for_each_possible_cpu(cpu) {
+            if (cpu_to_node(cpu) != node)
+                continue;
+            stats = &per_cpu(node_stats, cpu);
+            local_accesses += stats->local_accesses;
+            remote_accesses += stats->remote_accesses;
+            remote_allocations += stats->remote_allocations;
+        }
+        len += sprintf(page + len, "node%d_local_accesses %lu\n", node, local_accesses);
+        len += sprintf(page + len, "node%d_remote_accesses %lu\n", node, remote_accesses);
+        len += sprintf(page + len, "node%d_remote_allocations %lu\n", node, remote_allocations);
+    }
+    *eof = 1;
+    return len;
 }
 
 
@@ -567,87 +2124,199 @@ static void release_data_block(void *data_block_ptr) {
  *
  */
 
-// returns a boolean value indicating whether ramdisk is ready for use
-bool rd_initialized() {
-    bool ret;
-    read_lock(&rd_init_rwlock);
-    ret = rd_initialized_flag;
-    read_unlock(&rd_init_rwlock);
-    return ret;
+// returns a boolean value indicating whether ramdisk is ready for use
+bool rd_initialized() {
+    bool ret;
+    read_lock(&rd_init_rwlock);
+    ret = rd_initialized_flag;
+    read_unlock(&rd_init_rwlock);
+    return ret;
+}
+
+/*
+ *  Lays out a ramdisk of size bytes with at least inodes index nodes in sb:
+ *  the super block, the index node table, the block bitmap and the data
+ *  blocks, in that order. Returns 0, or -EINVAL if they don't fit.
+ */
+static int compute_layout(super_block_t *sb, unsigned long size, unsigned long inodes) {
+    unsigned long total_blocks = size / BLOCK_SIZE, remaining = 0;
+    if (inodes < 2 || inodes > UINT_MAX)
+        return -EINVAL;
+    sb->index_node_blocks = DIV_ROUND_UP(inodes, BLOCK_SIZE / INDEX_NODE_SIZE);
+    sb->num_index_nodes = sb->index_node_blocks * (BLOCK_SIZE / INDEX_NODE_SIZE);
+    if (total_blocks < sb->index_node_blocks + 4)
+        return -EINVAL;
+    remaining = total_blocks - 1 - sb->index_node_blocks;
+    // every bitmap block covers BLOCK_SIZE * 8 data blocks
+    sb->bitmap_blocks = DIV_ROUND_UP(remaining, BLOCK_SIZE * 8 + 1);
+    // block maps hold 32 bit block numbers
+    sb->data_blocks = min_t(unsigned long, remaining - sb->bitmap_blocks, UINT_MAX);
+    atomic_long_set(&sb->num_free_blocks, sb->data_blocks - 1);
+    atomic_long_set(&sb->num_free_inodes, sb->num_index_nodes - 1);
+    return 0;
+}
+
+// Frees the ramdisk, its chunks and the in-memory indexes built over it
+static void free_ramdisk_memory(void) {
+    unsigned long chunk = 0;
+    if (chunk_pages != NULL) {
+        for (chunk = 0; chunk < num_block_groups; chunk++)
+            if (CHUNK_BACKED(chunk))
+                free_chunk(&chunk_pages[chunk * PAGES_PER_CHUNK], PAGES_PER_CHUNK);
+        atomic_long_set(&populated_chunks, 0);
+    }
+    if (metadata_order >= 0 && super_block != NULL)
+        free_pages((unsigned long) super_block, metadata_order);
+    else
+        vfree(super_block);
+    metadata_order = -1;
+    vfree(chunk_pages);
+    vfree(block_group_free);
+    vfree(block_group_summary);
+    vfree(block_zeroed);
+    vfree(free_inode_stack);
+    vfree(chunk_node);
+    chunk_pages = NULL;
+    super_block = NULL;
+    block_group_free = NULL;
+    block_group_summary = NULL;
+    block_zeroed = NULL;
+    free_inode_stack = NULL;
+    chunk_node = NULL;
 }
 
 // Initializaton routine must be called once to initialize ramdisk memory before other functions are called
 int rd_init() {
-    const super_block_t init_super_block = {.num_free_blocks = BLOCK_DATA,
-            .num_free_inodes = BLOCK_INDEX_NODES * BLOCK_SIZE / INDEX_NODE_SIZE - 1};
+    super_block_t init_super_block;
     const index_node_t root_inode = {.type = DIR,
+            .flags = INODE_INLINE,
             .size = 0,
             .open_count = ATOMIC_INIT(0),
             .file_lock = RW_LOCK_UNLOCKED,
-            .direct = {NULL},
-            .single_indirect = NULL,
-            .double_indirect = NULL};
+            .home_node = NO_HOME_NODE};
     const index_node_t regular_inode = {.type = UNALLOCATED,
+            .flags = INODE_INLINE,
             .size = 0,
             .open_count = ATOMIC_INIT(0),
             .file_lock = RW_LOCK_UNLOCKED,
-            .direct = {NULL},
-            .single_indirect = NULL,
-            .double_indirect = NULL};
-    int i = 0;
+            .home_node = NO_HOME_NODE};
+    unsigned long i = 0, ramdisk_bytes = 0;
+    int cpu = 0;
     index_node_t *inode = NULL;
+    block_magazine_t *mag = NULL;
+    // the block and inode layouts are computed from the geometry profile in data_structures.h
+    BUILD_BUG_ON(sizeof(indirect_block_t) != BLOCK_SIZE);
+    BUILD_BUG_ON(sizeof(index_node_t) != INDEX_NODE_SIZE);
+    // the block pointers and the inline data share the second line, which holds two directory entries inline
+    BUILD_BUG_ON(offsetof(index_node_t, indirect) - offsetof(index_node_t, direct) != DIRECT * BLOCK_POINTER_SIZE);
+    BUILD_BUG_ON(INLINE_DATA_SIZE < (DIRECT + INDIRECT_LEVELS) * BLOCK_POINTER_SIZE);
+    BUILD_BUG_ON(INLINE_DATA_SIZE < 2 * DIR_ENTRY_SIZE);
+    BUILD_BUG_ON(BLOCK_SIZE % INDEX_NODE_SIZE != 0 || BLOCK_SIZE % DIR_ENTRY_SIZE != 0);
+    BUILD_BUG_ON(sizeof(directory_entry_t) != DIR_ENTRY_SIZE);
+    BUILD_BUG_ON(sizeof(extent_t) != EXTENT_SIZE || sizeof(extent_header_t) != EXTENT_HEADER_SIZE);
+    BUILD_BUG_ON(sizeof(extent_node_t) > BLOCK_SIZE || ROOT_EXTENTS < 2);
+    BUILD_BUG_ON(PAGE_SIZE % BLOCK_SIZE != 0 && BLOCK_SIZE % PAGE_SIZE != 0);
+    mutex_lock(&rd_init_mutex);
     if (rd_initialized()) {
+        mutex_unlock(&rd_init_mutex);
         return -EALREADY;
     }
-    write_lock(&rd_init_rwlock);
     printk(KERN_INFO "Initializing ramdisk\n");
-    super_block = (super_block_t *) vmalloc(RD_SIZE);
-    if (!super_block) {
-        printk(KERN_ERR "vmalloc for ramdisk space failed\n");
-        write_unlock(&rd_init_rwlock);
+    memset(&init_super_block, 0, sizeof(super_block_t));
+    if (compute_layout(&init_super_block, rd_size, rd_inodes) != 0) {
+        printk(KERN_ERR "rd_size %lu is too small for rd_inodes %lu\n", rd_size, rd_inodes);
+        mutex_unlock(&rd_init_mutex);
+        return -EINVAL;
+    }
+    num_index_nodes = init_super_block.num_index_nodes;
+    num_data_blocks = init_super_block.data_blocks;
+    num_block_groups = DIV_ROUND_UP(num_data_blocks, BLOCK_GROUP_SIZE);
+    // only the metadata is allocated up front, the data blocks are backed chunk by chunk
+    ramdisk_bytes = BLOCK_SIZE * (1 + init_super_block.index_node_blocks + init_super_block.bitmap_blocks);
+    super_block = (super_block_t *) alloc_metadata(ramdisk_bytes);
+    chunk_pages = (void **) vmalloc(num_block_groups * PAGES_PER_CHUNK * sizeof(void *));
+    block_group_free = (atomic_t *) vmalloc(num_block_groups * sizeof(atomic_t));
+    block_group_summary = (unsigned long *) vmalloc(BITS_TO_LONGS(num_block_groups) * sizeof(unsigned long));
+    block_zeroed = (unsigned long *) vmalloc(BITS_TO_LONGS(num_data_blocks) * sizeof(unsigned long));
+    free_inode_stack = (unsigned int *) vmalloc(num_index_nodes * sizeof(unsigned int));
+    chunk_node = (unsigned short *) vmalloc(num_block_groups * sizeof(unsigned short));
+    if (!super_block || !chunk_pages || !block_group_free || !block_group_summary || !block_zeroed || !free_inode_stack ||
+        !chunk_node) {
+        printk(KERN_ERR "Failed to allocate ramdisk metadata\n");
+        free_ramdisk_memory();
+        mutex_unlock(&rd_init_mutex);
         return -ENOMEM;
     }
-    memset((void *) super_block, 0, RD_SIZE);
+    memset((void *) super_block, 0, ramdisk_bytes);
+    memset(chunk_pages, 0, num_block_groups * PAGES_PER_CHUNK * sizeof(void *));
+    // the metadata is page aligned, so every inode starts on a cache line
     index_nodes = (index_node_t *) ((void *) super_block + BLOCK_SIZE);
-    block_bitmap = ((void *) index_nodes + BLOCK_INDEX_NODES * BLOCK_SIZE);
-    data_blocks = block_bitmap + BLOCK_BITMAPS * BLOCK_SIZE;
+    block_bitmap = ((void *) index_nodes + init_super_block.index_node_blocks * BLOCK_SIZE);
     *super_block = init_super_block;
-    rd_initialized_flag = true;
     index_nodes[0] = root_inode;
-    for (i = 1; i < INDEX_NODES; i++) {
+    if (rd_extents)
+        index_nodes[0].flags |= INODE_EXTENTS;
+    for (i = 1; i < num_index_nodes; i++) {
         inode = get_inode(i);
         *inode = regular_inode;
     }
+    // stack the free inodes so that the lowest numbers are handed out first
+    free_inode_top = 0;
+    for (i = num_index_nodes - 1; i >= 1; i--)
+        free_inode_stack[free_inode_top++] = i;
+    rebuild_block_group_index();
+    split_node_pools();
+    for_each_possible_cpu(cpu) {
+        mag = &per_cpu(block_magazines, cpu);
+        memset(mag, 0, sizeof(block_magazine_t));
+        spin_lock_init(&mag->lock);
+        memset(&per_cpu(node_stats, cpu), 0, sizeof(node_stats_t));
+    }
+    // no chunk is backed yet, so every data block starts out known zero but the reservoir is empty
+    memset(block_zeroed, 0xff, BITS_TO_LONGS(num_data_blocks) * sizeof(unsigned long));
+    clear_bit(0, block_zeroed);
+    atomic_long_set(&zeroed_free_blocks, 0);
+    zero_blocks_requested = false;
+    write_lock(&rd_init_rwlock);
+    rd_initialized_flag = true;
     write_unlock(&rd_init_rwlock);
-    printk("Num data_block at init: %d\n", super_block->num_free_blocks);
-    printk("Num inodes at init: %d\n", super_block->num_free_inodes);
+    zero_blocks_task = kthread_run(zero_blocks_thread, NULL, "rd_zerod");
+    if (IS_ERR(zero_blocks_task)) {
+        // allocations just keep zeroing synchronously
+        printk(KERN_ERR "Failed to start block zeroing thread\n");
+        zero_blocks_task = NULL;
+    }
+    mutex_unlock(&rd_init_mutex);
+    printk("Num data_block at init: %ld\n", atomic_long_read(&super_block->num_free_blocks));
+    printk("Num inodes at init: %ld\n", atomic_long_read(&super_block->num_free_inodes));
     return 0;
 }
 
 
 // Returns the address of the offset bytes of the data associated with inode or NULL on error. To be called with readlock held
-static void *get_byte_address(index_node_t *inode, int offset) {
-    int data_block_num, indirect_block_num, dbl_indirect_block_num, offset_into_block;
-    void *offset_address = NULL, *block_start_address;
+static void *get_byte_address(index_node_t *inode, loff_t offset) {
+    void *block_start_address = NULL;
     if (offset >= inode->size)
-        return offset_address;
-
-    data_block_num = offset / BLOCK_SIZE;       //integer division
-    offset_into_block = offset % BLOCK_SIZE;
+        return NULL;
+    if (inode->flags & INODE_INLINE)
+        return INLINE_DATA(inode) + offset;
+    block_start_address = lookup_block(inode, offset / BLOCK_SIZE);
+    if (block_start_address == NULL)
+        return NULL;
+    return block_start_address + offset % BLOCK_SIZE;
+}
 
-    if (data_block_num < DIRECT) {      //direct
-        block_start_address = inode->direct[data_block_num];
-    } else if (data_block_num < DIRECT + POINTER_PER_BLOCK) {   //single indirect
-        indirect_block_num = data_block_num - DIRECT;
-        block_start_address = inode->single_indirect->data[indirect_block_num];
-    } else {                            //double indirect
-        dbl_indirect_block_num = (data_block_num - (DIRECT + POINTER_PER_BLOCK)) / POINTER_PER_BLOCK;
-        indirect_block_num = data_block_num - (DIRECT + POINTER_PER_BLOCK) - dbl_indirect_block_num * POINTER_PER_BLOCK;
-        block_start_address = inode->double_indirect->indirect_blocks[dbl_indirect_block_num]->
-                data[indirect_block_num];
-    }
-    offset_address = block_start_address + offset_into_block;
-    return offset_address;
+// Like get_byte_address, but looks the block up through cursor. To be called with readlock held
+static void *get_cached_byte_address(index_node_t *inode, block_cursor_t *cursor, loff_t offset) {
+    void *block_start_address = NULL;
+    if (offset >= inode->size)
+        return NULL;
+    if (inode->flags & INODE_INLINE)
+        return INLINE_DATA(inode) + offset;
+    block_start_address = lookup_block_cached(inode, cursor, offset / BLOCK_SIZE);
+    if (block_start_address == NULL)
+        return NULL;
+    return block_start_address + offset % BLOCK_SIZE;
 }
 
 
@@ -667,12 +2336,20 @@ static int rd_creat(const char *usr_str) {
     if (pathname == NULL)
         return -1;
     strncpy_from_user(pathname, usr_str, usr_str_len);
+    // if pathname is overflow, free it (the filename needs room for its null terminator)
+    if (strrchr(pathname, '/') == NULL || strlen(strrchr(pathname, '/') + 1) >= MAX_FILE_NAME_LEN) {
+        kfree(pathname);
+        return -EINVAL;
+    }
+
 
     existing_node = get_readlocked_index_node(pathname);
     if (existing_node != NULL) {
         read_unlock(&existing_node->file_lock);
         return -EEXIST;
     }
+    // the new entry may need a block for the parent directory
+    wait_for_reclaim(BLOCK_SIZE);
 
     index_node_t *parent = get_readlocked_parent_index_node(pathname);
     if (parent == NULL) {
@@ -697,20 +2374,19 @@ static int rd_creat(const char *usr_str) {
     new_inode_ptr->type = REG;
     write_lock(&parent->file_lock);
     atomic_dec(&parent->open_count);
+    new_inode_ptr->home_node = parent->home_node;
     // link to new index node in parent
-    directory_entry_t *entry = NULL;
-    if (parent->size % BLOCK_SIZE == 0) {
-        entry = (directory_entry_t *) extend_inode(parent);
-    } else {
-        entry = get_directory_entry(parent, parent->size / DIR_ENTRY_SIZE - 1) + 1;
-    }
+    directory_entry_t *entry = append_directory_entry(parent);
     if (entry == NULL) {
+        // the directory couldn't grow, give the unlinked inode back
+        new_inode_ptr->type = UNALLOCATED;
         write_unlock(&new_inode_ptr->file_lock);
         write_unlock(&parent->file_lock);
+        put_free_index_node(new_inode_ptr);
         kfree(pathname);
         return -EFBIG;
     }
-    entry->index_node_number = ((void *) new_inode_ptr - (void *) index_nodes) / INDEX_NODE_SIZE;
+    entry->index_node_number = get_inode_number(new_inode_ptr);
     strncpy(entry->filename, strrchr(pathname, '/') + 1, MAX_FILE_NAME_LEN);
     parent->size += DIR_ENTRY_SIZE;
     write_unlock(&new_inode_ptr->file_lock);
@@ -734,8 +2410,8 @@ static int rd_mkdir(const char *usr_str) {
     if (pathname == NULL)
         return -1;
     strncpy_from_user(pathname, usr_str, usr_str_len);
-    // if pathname is overflow, free it
-    if (strlen(strrchr(pathname, '/') + 1) > MAX_FILE_NAME_LEN) {
+    // if pathname is overflow, free it (the filename needs room for its null terminator)
+    if (strlen(strrchr(pathname, '/') + 1) >= MAX_FILE_NAME_LEN) {
         kfree(pathname);
         return -EINVAL;
     }
@@ -745,6 +2421,8 @@ static int rd_mkdir(const char *usr_str) {
         read_unlock(&existing_node->file_lock);
         return -EEXIST;
     }
+    // the new entry may need a block for the parent directory
+    wait_for_reclaim(BLOCK_SIZE);
 
     index_node_t *parent = get_readlocked_parent_index_node(pathname);
     if (parent == NULL) {
@@ -769,21 +2447,20 @@ static int rd_mkdir(const char *usr_str) {
     new_inode_ptr->type = DIR;
     write_lock(&parent->file_lock);
     atomic_dec(&parent->open_count);
+    new_inode_ptr->home_node = parent->home_node;
     // link to new index node in parent
-    directory_entry_t *entry = NULL;
-    if (parent->size % BLOCK_SIZE == 0) {
-        entry = (directory_entry_t *) extend_inode(parent);
-    } else {
-        entry = get_directory_entry(parent, parent->size / DIR_ENTRY_SIZE - 1) + 1;
-    }
+    directory_entry_t *entry = append_directory_entry(parent);
     if (entry == NULL) {
+        // the directory couldn't grow, give the unlinked inode back
+        new_inode_ptr->type = UNALLOCATED;
         write_unlock(&new_inode_ptr->file_lock);
         write_unlock(&parent->file_lock);
+        put_free_index_node(new_inode_ptr);
         kfree(pathname);
         return -EFBIG;
     }
 
-    entry->index_node_number = ((void *) new_inode_ptr - (void *) index_nodes) / INDEX_NODE_SIZE;
+    entry->index_node_number = get_inode_number(new_inode_ptr);
     strncpy(entry->filename, strrchr(pathname, '/') + 1, MAX_FILE_NAME_LEN);
     parent->size += DIR_ENTRY_SIZE;
     write_unlock(&new_inode_ptr->file_lock);
@@ -793,7 +2470,7 @@ static int rd_mkdir(const char *usr_str) {
 }
 
 static int rd_unlink(const char *usr_str) {
-    int i = 0, indirect_block_num = 0, dir_block_num = 0, open_count = 0;
+    int i = 0, dir_block_num = 0, open_count = 0;
     char *pathname = NULL;
     size_t usr_strlen = strlen_user(usr_str);
     index_node_t *node = NULL;
@@ -836,82 +2513,29 @@ static int rd_unlink(const char *usr_str) {
                 kfree(pathname);
                 return -EINVAL;
             }
-            if (node->type == DIR) {
-                if (node->size != 0) {
-                    printk("attempt to unlink a non-empty directory file!\n");
-                    write_unlock(&parent_node->file_lock);
-                    write_unlock(&node->file_lock);
-                    kfree(pathname);
-                    return -EINVAL;
-                }
-            } else {
-                // release all datablocks
-                int num_blocks = node->size / BLOCK_SIZE;
-                void *block_to_release = NULL;
-                while (num_blocks != 0) {
-                    block_to_release = get_byte_address(node, (num_blocks - 1) * BLOCK_SIZE);
-                    release_data_block(block_to_release);
-                    num_blocks--;
-                }
-                if (node->double_indirect != NULL) {
-                    // need to release the double indirect block and the single indirect blocks pointed to from it
-                    for (indirect_block_num = 0; indirect_block_num < POINTER_PER_BLOCK; indirect_block_num++) {
-                        if (node->double_indirect->indirect_blocks[indirect_block_num] != NULL)
-                            release_data_block(node->double_indirect->indirect_blocks[indirect_block_num]);
-                    }
-                    release_data_block(node->double_indirect);
-                    node->double_indirect = NULL;
-                }
-                if (node->single_indirect != NULL)
-                    release_data_block(node->single_indirect);
+            if (node->type == DIR && node->size != 0) {
+                printk("attempt to unlink a non-empty directory file!\n");
+                write_unlock(&parent_node->file_lock);
+                write_unlock(&node->file_lock);
+                kfree(pathname);
+                return -EINVAL;
             }
+            // hand all datablocks, including those an empty directory kept preallocated,
+            // to the reclaim worker, the inode is reset below
+            defer_block_reclaim(node);
 
             // delete entry in parent
             directory_entry_t *last_entry = get_directory_entry(parent_node, last_entry_index);
             if (entry != last_entry)
                 *entry = *last_entry;
             parent_node->size -= DIR_ENTRY_SIZE;
-            if (parent_node->size % BLOCK_SIZE == 0) {
-                release_data_block(last_entry);
-                // remove last location(DIRECT)
-                if (parent_node->size / BLOCK_SIZE < DIRECT) {
-                    parent_node->direct[parent_node->size / BLOCK_SIZE] = NULL;
-                } else if (parent_node->size / BLOCK_SIZE < DIRECT + POINTER_PER_BLOCK) { // if it's single indirect
-                    if (parent_node->size / BLOCK_SIZE == DIRECT) {
-                        // need to also release the indirect block
-                        release_data_block(parent_node->single_indirect);
-                        parent_node->single_indirect = NULL;
-                    } else {
-                        // need to NULL out the entry in SINGLE_INDIRECT block that pointed to the directory entry block we just released
-                        for (dir_block_num = 0; dir_block_num < POINTER_PER_BLOCK; dir_block_num++) {
-                            if (parent_node->single_indirect->data[dir_block_num] == last_entry)
-                                parent_node->single_indirect->data[dir_block_num] = NULL;
-                        }
-                    }
-                } else if (parent_node->size / BLOCK_SIZE < DIRECT + POINTER_PER_BLOCK * (1 + POINTER_PER_BLOCK)) { //if it's double indirect
-                    if (parent_node->size / BLOCK_SIZE == DIRECT + POINTER_PER_BLOCK) {
-                        // need to release the single indirect block that pointed to the entry we just released and also the double indirect block
-                        release_data_block(parent_node->double_indirect->indirect_blocks[0]);
-                        release_data_block(parent_node->double_indirect);
-                        parent_node->double_indirect = NULL;
-                    } else if ((parent_node->size / BLOCK_SIZE) % (POINTER_PER_BLOCK * BLOCK_SIZE) != 0) {
-                        // need to NULL out the entry in SINGLE_INDIRECT block that pointed to the directory entry block we just released
-                        int indirect_block_index = (parent_node->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) / (POINTER_PER_BLOCK * BLOCK_SIZE);
-                        int index_in_indirect_block = ((parent_node->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) % (POINTER_PER_BLOCK * BLOCK_SIZE)) / BLOCK_SIZE;
-                        parent_node->double_indirect->indirect_blocks[indirect_block_index]->data[index_in_indirect_block] = NULL;
-                    } else if ((parent_node->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) % (POINTER_PER_BLOCK * BLOCK_SIZE) == 0) {
-                        /* Need to free the SINGLE_INDIRECT block that pointed to the
-                       directory entry block we just released, and
-                       NULL out the entry in the DOUBLE_INDIRECT block
-                       that pointed to this SINGLE_INDIRECT block
-                        */
-                        int indirect_block_index = (parent_node->size - BLOCK_SIZE * (DIRECT + POINTER_PER_BLOCK)) / (POINTER_PER_BLOCK * BLOCK_SIZE);
-                        release_data_block(parent_node->double_indirect->indirect_blocks[indirect_block_index]);
-                        parent_node->double_indirect->indirect_blocks[indirect_block_index] = NULL;
-                    } else {
-                        printk(KERN_ERR "Encountered unexpected case in rd_unlink\n");
-                    }
-                }
+            if (!(parent_node->flags & INODE_INLINE) && parent_node->size % BLOCK_SIZE == 0 &&
+                lookup_block_num(parent_node, parent_node->size / BLOCK_SIZE + 1) == 0) {
+                // the last entry was alone in its block, and no block preallocated by rd_fallocate follows
+                truncate_blocks(parent_node, parent_node->size / BLOCK_SIZE);
+                // an empty directory goes back to storing its entries inline
+                if (parent_node->size == 0)
+                    parent_node->flags |= INODE_INLINE;
             }
             break;
         }
@@ -924,17 +2548,15 @@ static int rd_unlink(const char *usr_str) {
 
     // init node
     node->type = UNALLOCATED;
+    node->flags = INODE_INLINE;
     node->size = 0;
     atomic_set(&node->open_count, 0);
-    for (i = 0; i < DIRECT; i++)
-        node->direct[i] = NULL;
-    node->single_indirect = NULL;
-    node->double_indirect = NULL;
+    memset(INLINE_DATA(node), 0, INLINE_DATA_SIZE);
+    node->home_node = NO_HOME_NODE;
+    node->generation++;
     write_unlock(&node->file_lock);
     kfree(pathname);
-    spin_lock(&super_block_spinlock);
-    super_block->num_free_inodes++;
-    spin_unlock(&super_block_spinlock);
+    put_free_index_node(node);
     return 0;
 }
 
@@ -944,7 +2566,6 @@ static int rd_open(const pid_t pid, const char *usr_str) {
     int ret;
     pathname = kcalloc(usr_strlen, sizeof(char), GFP_KERNEL);
     strncpy_from_user(pathname, usr_str, usr_strlen);
-    printk("Opening %s\n", pathname);
 
     // remove trailing forward slash, if it exists
     if (usr_strlen > 2 && pathname[usr_strlen - 1] == '/')
@@ -990,19 +2611,137 @@ static int rd_close(const pid_t pid, const int fd) {
     return delete_file_descriptor_table_entry(fdt, fd);
 }
 
-static int rd_read(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
-    rd_rwfile_arg_t *read_arg = NULL;
-    unsigned long data_requested = 0,
-            data_fulfillable = 0,
-            data_left_to_read = 0,
+/*
+ *  Copies up to count bytes of the regular file inode from offset *pos on into
+ *  buf and advances *pos past them. buf has to come zeroed, a hole is skipped
+ *  rather than copied. Returns the number of bytes read, 0 at or past EOF.
+ *  To be called with a lock on inode held.
+ */
+static unsigned long read_inode(index_node_t *inode, block_cursor_t *cursor, loff_t *pos, void *buf,
+                                unsigned long count) {
+    unsigned long data_left_to_read = count,
             bytes_until_end_of_block = 0,
             bytes_left_in_file = 0,
             data_to_be_read_at_address = 0,
+            data_to_copy = 0;
+    void *dest = buf, *from = NULL;
+    node_stats_t *stats = NULL;
+
+    if (inode->flags & INODE_INLINE) {
+        // the whole file sits in the inode, no block to look up
+        if (*pos < inode->size) {
+            data_to_copy = min_t(loff_t, data_left_to_read, inode->size - *pos);
+            memcpy(dest, INLINE_DATA(inode) + *pos, data_to_copy);
+            data_left_to_read -= data_to_copy;
+            *pos += data_to_copy;
+        }
+        // anything left to read is past EOF, where the loop below stops right away
+    }
+
+    stats = &get_cpu_var(node_stats);
+    while (data_left_to_read > 0) {
+        if (*pos >= inode->size) // *pos is at or past EOF
+            break;
+
+        // NULL for a hole of a sparse file
+        from = get_cached_byte_address(inode, cursor, *pos);
+        bytes_until_end_of_block = BLOCK_SIZE - *pos % BLOCK_SIZE;
+        bytes_left_in_file = inode->size - *pos;
+        data_to_be_read_at_address = min(bytes_until_end_of_block, bytes_left_in_file);
+        data_to_copy = min(data_to_be_read_at_address, data_left_to_read);
+        if (from != NULL) {
+            count_block_access(stats, numa_node_id(), from);
+            memcpy(dest, from, data_to_copy);
+        }
+        data_left_to_read -= data_to_copy;
+        dest += data_to_copy;
+        *pos += data_to_copy;
+    }
+    put_cpu_var(node_stats);
+    return count - data_left_to_read;
+}
+
+/*
+ *  Copies count bytes from buf into the regular file inode from offset *pos
+ *  on, which has to be below MAX_FILE_SIZE, and advances *pos past them.
+ *  Blocks are allocated for the holes and the part past EOF, and the file
+ *  grows to *pos. Returns the number of bytes written, fewer than count if
+ *  the ramdisk is full. To be called with write lock held.
+ */
+static unsigned long write_inode(index_node_t *inode, block_cursor_t *cursor, loff_t *pos, const void *buf,
+                                 unsigned long count) {
+    unsigned long data_left_to_write = count,
             data_to_copy = 0,
-            num_copied = 0,
+            space_available_at_dest = 0,
+            block_index = 0,
+            wanted = 0;
+    loff_t write_end = 0, new_start = 0;
+    void *dest = NULL;
+    const void *src = buf;
+    node_stats_t *stats = NULL;
+    block_reservation_t res;
+
+    if (inode->flags & INODE_INLINE) {
+        if (*pos + count <= INLINE_DATA_SIZE) {
+            // the file still fits in its inode, whose bytes past EOF are zero
+            memcpy(INLINE_DATA(inode) + *pos, src, count);
+            *pos += count;
+            inode->size = max(inode->size, *pos);
+            return count;
+        } else if (promote_inline_data(inode) != 0) {
+            return 0;
+        }
+    }
+
+    stats = &get_cpu_var(node_stats);
+
+    // an overwrite that ends by EOF goes straight to the mapped blocks, with no reservation
+    // and no size update, only a hole in the range takes a block from the allocator
+    write_end = min_t(loff_t, *pos + data_left_to_write, MAX_FILE_SIZE);
+    if (write_end > inode->size) {
+        // reserve the blocks this write adds past EOF in one run where possible, holes before it take none
+        new_start = max(inode->size, *pos - *pos % BLOCK_SIZE);
+        // nothing to reserve if rd_fallocate already mapped the end of the range
+        if (lookup_block_num(inode, (write_end - 1) / BLOCK_SIZE) == 0)
+            wanted = count_mapped_blocks(inode, write_end) - count_mapped_blocks(inode, new_start);
+    }
+    reserve_data_blocks(&res, wanted,
+                        wanted > 0 ? next_block_goal(inode, DIV_ROUND_UP(new_start, BLOCK_SIZE)) : NO_BLOCK);
+
+    while (data_left_to_write > 0) {
+        if (*pos >= MAX_FILE_SIZE)
+            break;
+
+        block_index = *pos / BLOCK_SIZE;
+        dest = lookup_block_cached(inode, cursor, block_index);
+        if (dest == NULL) {
+            // past the last block of the file, or in a hole
+            dest = allocate_file_block(inode, block_index, &res);
+            if (dest == NULL)
+                break;
+        }
+        dest += *pos % BLOCK_SIZE;
+        space_available_at_dest = BLOCK_SIZE - *pos % BLOCK_SIZE;
+        data_to_copy = min(data_left_to_write, space_available_at_dest);
+        count_block_access(stats, numa_node_id(), dest);
+        memcpy(dest, src, data_to_copy);
+        data_left_to_write -= data_to_copy;
+        src += data_to_copy;
+        *pos += data_to_copy;
+        if (inode->size < *pos) // We wrote past original EOF
+            inode->size = *pos;
+    }
+    release_reserved_data_blocks(&res);
+    put_cpu_var(node_stats);
+    return count - data_left_to_write;
+}
+
+static int rd_read(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
+    rd_rwfile_arg_t *read_arg = NULL;
+    unsigned long data_fulfillable = 0,
+            num_read = 0,
             num_not_copied = 0;
-    void *dest = NULL, *from = NULL, *data_buf = NULL;
-    index_node_t *inode = NULL;
+    void *data_buf = NULL;
     // make sure the process has a file descriptor table
     file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
     if (fdt == NULL)
@@ -1016,23 +2755,20 @@ static int rd_read(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
         kfree(read_arg);
         return -EINVAL;
     }
-    data_requested = read_arg->num_bytes;
-    data_fulfillable = min(data_requested, MAX_FILE_SIZE);
-    data_left_to_read = data_fulfillable;
+    data_fulfillable = min_t(loff_t, read_arg->num_bytes, MAX_FILE_SIZE);
     file_object_t fo = get_file_descriptor_table_entry(fdt, read_arg->fd);
     if (fo.index_node == NULL) {
         kfree(read_arg);
         return -EINVAL;
     }
 
+    // zeroed, so a hole reads as zeros
     data_buf = kcalloc(data_fulfillable, 1, GFP_KERNEL);
     if (data_buf == NULL) {
         kfree(read_arg);
         return -EINVAL;
     }
 
-    dest = data_buf;
-
     read_lock(&fo.index_node->file_lock);
 
     if (fo.index_node->type != REG) {
@@ -1042,43 +2778,21 @@ static int rd_read(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
         return -EINVAL;
     }
 
-    inode = fo.index_node;
-
-    // start reading data
-    while (data_left_to_read > 0) {
-        if (fo.file_position == inode->size) // file_position is at EOF
-            break;
-
-        from = get_byte_address(inode, fo.file_position);
-        bytes_until_end_of_block = (unsigned long) BLOCK_END(from) - (unsigned long) from;
-        bytes_left_in_file = inode->size - fo.file_position;
-        data_to_be_read_at_address = min(bytes_until_end_of_block, bytes_left_in_file);
-        data_to_copy = min(data_to_be_read_at_address, data_left_to_read);
-        memcpy(dest, from, data_to_copy);
-        num_copied = data_to_copy;
-        data_left_to_read -= num_copied;
-        dest += num_copied;
-        fo.file_position += num_copied;
-        if (num_not_copied > 0) break;
-    }
+    num_read = read_inode(fo.index_node, &fo.cursor, &fo.file_position, data_buf, data_fulfillable);
     read_unlock(&fo.index_node->file_lock);
     set_file_descriptor_table_entry(fdt, read_arg->fd, fo);
-    copy_to_user(read_arg->address, data_buf, data_requested - data_left_to_read);
+    copy_to_user(read_arg->address, data_buf, num_read);
     kfree(read_arg);
     kfree(data_buf);
-    return data_fulfillable - data_left_to_read;
+    return num_read;
 }
 
 static int rd_write(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
     rd_rwfile_arg_t *write_arg = NULL;
-    unsigned long data_requested = 0,
-            data_fulfillable = 0,
-            data_left_to_write = 0,
-            data_to_copy = 0,
-            space_available_at_dest = 0,
-            num_copied = 0,
+    unsigned long data_fulfillable = 0,
+            num_written = 0,
             num_not_copied = 0;
-    void *curr_offset_address = NULL, *dest = NULL, *src = NULL, *data_buf = NULL;
+    void *data_buf = NULL;
     index_node_t *inode = NULL;
     // make sure the process has a file descriptor table
     file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
@@ -1095,9 +2809,7 @@ static int rd_write(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
         return -EINVAL;
     }
 
-    data_requested = write_arg->num_bytes;
-    data_fulfillable = min(data_requested, MAX_FILE_SIZE);
-    data_left_to_write = data_fulfillable;
+    data_fulfillable = min_t(loff_t, write_arg->num_bytes, MAX_FILE_SIZE);
 
     file_object_t fo = get_file_descriptor_table_entry(fdt, write_arg->fd);
     if (fo.index_node == NULL) {
@@ -1116,14 +2828,14 @@ static int rd_write(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
     num_not_copied = copy_from_user(data_buf, write_arg->address, data_fulfillable);
     if (num_not_copied > 0) {
         printk(KERN_ERR
-        "Couldnt buffer the %d bytes requested to be written\n", data_requested);
+        "Couldnt buffer the %d bytes requested to be written\n", write_arg->num_bytes);
         kfree(write_arg);
         kfree(data_buf);
         return -EINVAL;
     }
 
-    src = data_buf;
     inode = fo.index_node;
+    wait_for_reclaim(data_fulfillable);
 
     if (!write_trylock(&inode->file_lock)) {
         kfree(write_arg);
@@ -1131,52 +2843,246 @@ static int rd_write(const pid_t pid, const rd_rwfile_arg_t *usr_arg) {
         return -EINVAL;
     }
 
-    if (inode->type != REG || inode->size == MAX_FILE_SIZE) {
+    if (inode->type != REG || fo.file_position >= MAX_FILE_SIZE) {
         write_unlock(&inode->file_lock);
         kfree(write_arg);
         kfree(data_buf);
         return -EINVAL;
     }
 
-    // start writing data
-    while (data_left_to_write > 0) {
-        if (fo.file_position == MAX_FILE_SIZE)
-            break;
+    num_written = write_inode(inode, &fo.cursor, &fo.file_position, data_buf, data_fulfillable);
+    write_unlock(&inode->file_lock);
+    set_file_descriptor_table_entry(fdt, write_arg->fd, fo);
+    kfree(data_buf);
+    kfree(write_arg);
+    return num_written;
+}
 
-        if (fo.file_position == inode->size && inode->size % BLOCK_SIZE == 0) {
-            // writing past the current end of the last block of file
-            printk("Getting new data block for inode\n");
-            dest = extend_inode(inode);
-            if (dest == NULL)
-                break;
-            space_available_at_dest = BLOCK_SIZE;
-        } else {
-            curr_offset_address = get_byte_address(inode, inode->size - 1);
-            if (curr_offset_address == NULL) {
-                printk(KERN_ERR "Unexpected error getting byte address of byte %d in rd_write\n", inode->size - 1);
-                break;
-            }
-            dest = curr_offset_address + 1;
-            space_available_at_dest = (unsigned long) BLOCK_END(dest) - (unsigned long) dest;
+/*
+ *  Like rd_read, but reads at the given offset and leaves the file position
+ *  of fd alone, so threads sharing fd can read at once without seeking.
+ */
+static int rd_pread(const pid_t pid, const rd_prwfile_arg_t *usr_arg) {
+    rd_prwfile_arg_t pread_arg;
+    unsigned long data_fulfillable = 0, num_read = 0, not_copied = 0;
+    loff_t pos = 0;
+    void *data_buf = NULL;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    index_node_t *inode = NULL;
+    // a private, empty cursor: the fd's own may be rewritten by a concurrent rd_read or rd_lseek
+    block_cursor_t cursor = {.block_address = NULL};
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&pread_arg, usr_arg, sizeof(rd_prwfile_arg_t)) != 0 || pread_arg.num_bytes < 0 ||
+        pread_arg.offset < 0)
+        return -EINVAL;
+    data_fulfillable = min_t(loff_t, pread_arg.num_bytes, MAX_FILE_SIZE);
+    inode = get_file_descriptor_inode(fdt, pread_arg.fd);
+    if (inode == NULL)
+        return -EINVAL;
+    data_buf = kcalloc(data_fulfillable, 1, GFP_KERNEL);
+    if (data_buf == NULL)
+        return -EINVAL;
+    pos = pread_arg.offset;
+    read_lock(&inode->file_lock);
+    if (inode->type != REG) {
+        read_unlock(&inode->file_lock);
+        kfree(data_buf);
+        return -EINVAL;
+    }
+    num_read = read_inode(inode, &cursor, &pos, data_buf, data_fulfillable);
+    read_unlock(&inode->file_lock);
+    not_copied = copy_to_user(pread_arg.address, data_buf, num_read);
+    kfree(data_buf);
+    if (not_copied == num_read && num_read > 0)
+        return -EFAULT;
+    return num_read - not_copied;
+}
+
+/*
+ *  Like rd_write, but writes at the given offset and leaves the file position
+ *  of fd alone. Waits for the file lock instead of failing when another
+ *  writer holds it.
+ */
+static int rd_pwrite(const pid_t pid, const rd_prwfile_arg_t *usr_arg) {
+    rd_prwfile_arg_t pwrite_arg;
+    unsigned long data_fulfillable = 0, num_written = 0;
+    loff_t pos = 0;
+    void *data_buf = NULL;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    index_node_t *inode = NULL;
+    // a private, empty cursor, see rd_pread
+    block_cursor_t cursor = {.block_address = NULL};
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&pwrite_arg, usr_arg, sizeof(rd_prwfile_arg_t)) != 0 || pwrite_arg.num_bytes < 0 ||
+        pwrite_arg.offset < 0 || pwrite_arg.offset >= MAX_FILE_SIZE)
+        return -EINVAL;
+    data_fulfillable = min_t(loff_t, pwrite_arg.num_bytes, MAX_FILE_SIZE);
+    inode = get_file_descriptor_inode(fdt, pwrite_arg.fd);
+    if (inode == NULL)
+        return -EINVAL;
+    data_buf = kmalloc(data_fulfillable, GFP_KERNEL);
+    if (data_buf == NULL)
+        return -EFBIG;
+    if (copy_from_user(data_buf, pwrite_arg.address, data_fulfillable) != 0) {
+        kfree(data_buf);
+        return -EFAULT;
+    }
+    pos = pwrite_arg.offset;
+    wait_for_reclaim(data_fulfillable);
+    write_lock(&inode->file_lock);
+    if (inode->type != REG) {
+        write_unlock(&inode->file_lock);
+        kfree(data_buf);
+        return -EINVAL;
+    }
+    num_written = write_inode(inode, &cursor, &pos, data_buf, data_fulfillable);
+    write_unlock(&inode->file_lock);
+    kfree(data_buf);
+    return num_written;
+}
+
+/*
+ *  Copies the segment array of vec_arg in from user space and stores the sum
+ *  of the segment lengths in total. Returns the array, to be kfreed by the
+ *  caller, or NULL if it can't be copied, has more than UIO_MAXIOV segments
+ *  or adds up to more than an int return value can hold.
+ */
+static struct iovec *get_user_iovec(const rd_rwvec_arg_t *vec_arg, unsigned long *total) {
+    struct iovec *iov = NULL;
+    int i = 0;
+    if (vec_arg->iovcnt < 0 || vec_arg->iovcnt > UIO_MAXIOV)
+        return NULL;
+    iov = kmalloc(vec_arg->iovcnt * sizeof(struct iovec), GFP_KERNEL);
+    if (iov == NULL)
+        return NULL;
+    if (copy_from_user(iov, vec_arg->iov, vec_arg->iovcnt * sizeof(struct iovec)) != 0) {
+        kfree(iov);
+        return NULL;
+    }
+    *total = 0;
+    for (i = 0; i < vec_arg->iovcnt; i++) {
+        if (iov[i].iov_len > INT_MAX - *total) {
+            kfree(iov);
+            return NULL;
         }
-        data_to_copy = min(data_left_to_write, space_available_at_dest);
-        memcpy(dest, src, data_to_copy);
-        num_copied = data_to_copy;
-        data_left_to_write -= num_copied;
-        src += num_copied;
-        fo.file_position += num_copied;
-        if ((inode->size - 1) < fo.file_position) { // We wrote past original EOF
-            printk("Current inode size: %d\n", inode->size);
-            inode->size += fo.file_position - inode->size;
-            printk("New inode size: %d\n", inode->size);
+        *total += iov[i].iov_len;
+    }
+    return iov;
+}
+
+/*
+ *  Like rd_read, but scatters the data over the segments of an iovec array,
+ *  filling each one before the next. All segments are read under a single
+ *  acquisition of the file lock, through one buffer for the whole request.
+ */
+static int rd_readv(const pid_t pid, const rd_rwvec_arg_t *usr_arg) {
+    rd_rwvec_arg_t vec_arg;
+    struct iovec *iov = NULL;
+    unsigned long total = 0, num_read = 0, done = 0, len = 0, not_copied = 0;
+    void *data_buf = NULL;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    file_object_t fo;
+    loff_t start = 0;
+    int i = 0;
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&vec_arg, usr_arg, sizeof(rd_rwvec_arg_t)) != 0)
+        return -EINVAL;
+    iov = get_user_iovec(&vec_arg, &total);
+    if (iov == NULL)
+        return -EINVAL;
+    fo = get_file_descriptor_table_entry(fdt, vec_arg.fd);
+    // zeroed, so a hole reads as zeros
+    data_buf = fo.index_node != NULL ? kcalloc(total, 1, GFP_KERNEL) : NULL;
+    if (data_buf == NULL) {
+        kfree(iov);
+        return -EINVAL;
+    }
+    read_lock(&fo.index_node->file_lock);
+    if (fo.index_node->type != REG) {
+        read_unlock(&fo.index_node->file_lock);
+        kfree(data_buf);
+        kfree(iov);
+        return -EINVAL;
+    }
+    start = fo.file_position;
+    num_read = read_inode(fo.index_node, &fo.cursor, &fo.file_position, data_buf, total);
+    read_unlock(&fo.index_node->file_lock);
+    // copy_to_user can fault, which mustn't happen under the spinning file lock
+    for (i = 0; i < vec_arg.iovcnt && done < num_read; i++) {
+        len = min(iov[i].iov_len, num_read - done);
+        not_copied = copy_to_user(iov[i].iov_base, data_buf + done, len);
+        done += len - not_copied;
+        if (not_copied > 0)
+            break;
+    }
+    kfree(data_buf);
+    kfree(iov);
+    // only what reached the caller counts as read
+    fo.file_position = start + done;
+    set_file_descriptor_table_entry(fdt, vec_arg.fd, fo);
+    if (done == 0 && num_read > 0)
+        return -EFAULT;
+    return done;
+}
+
+/*
+ *  Like rd_write, but gathers the data from the segments of an iovec array in
+ *  order, so a record built from several buffers is written by one ioctl,
+ *  under a single acquisition of the file lock.
+ */
+static int rd_writev(const pid_t pid, const rd_rwvec_arg_t *usr_arg) {
+    rd_rwvec_arg_t vec_arg;
+    struct iovec *iov = NULL;
+    unsigned long total = 0, num_written = 0, done = 0;
+    void *data_buf = NULL;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    file_object_t fo;
+    index_node_t *inode = NULL;
+    int i = 0;
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&vec_arg, usr_arg, sizeof(rd_rwvec_arg_t)) != 0)
+        return -EINVAL;
+    iov = get_user_iovec(&vec_arg, &total);
+    if (iov == NULL)
+        return -EINVAL;
+    fo = get_file_descriptor_table_entry(fdt, vec_arg.fd);
+    inode = fo.index_node;
+    data_buf = inode != NULL ? kmalloc(total, GFP_KERNEL) : NULL;
+    if (data_buf == NULL) {
+        kfree(iov);
+        return -EINVAL;
+    }
+    // gather the segments before taking the spinning file lock, copy_from_user can fault
+    for (i = 0; i < vec_arg.iovcnt; i++) {
+        if (copy_from_user(data_buf + done, iov[i].iov_base, iov[i].iov_len) != 0) {
+            kfree(data_buf);
+            kfree(iov);
+            return -EFAULT;
         }
-        if (num_not_copied > 0) break;
+        done += iov[i].iov_len;
+    }
+    wait_for_reclaim(total);
+    if (!write_trylock(&inode->file_lock)) {
+        kfree(data_buf);
+        kfree(iov);
+        return -EINVAL;
     }
+    if (inode->type != REG || fo.file_position >= MAX_FILE_SIZE) {
+        write_unlock(&inode->file_lock);
+        kfree(data_buf);
+        kfree(iov);
+        return -EINVAL;
+    }
+    num_written = write_inode(inode, &fo.cursor, &fo.file_position, data_buf, total);
     write_unlock(&inode->file_lock);
-    set_file_descriptor_table_entry(fdt, write_arg->fd, fo);
+    set_file_descriptor_table_entry(fdt, vec_arg.fd, fo);
     kfree(data_buf);
-    kfree(write_arg);
-    return data_fulfillable - data_left_to_write;
+    kfree(iov);
+    return num_written;
 }
 
 static int rd_lseek(const pid_t pid, const rd_seek_arg_t *usr_arg) {
@@ -1203,9 +3109,8 @@ static int rd_lseek(const pid_t pid, const rd_seek_arg_t *usr_arg) {
         return -EINVAL;
     }
     read_lock(&fo.index_node->file_lock);
-    if (fo.index_node->type != REG ||
-        seek_arg->offset > fo.index_node->size
-        || seek_arg->offset >= MAX_FILE_SIZE) {
+    // seeking past EOF is fine, a write there leaves a hole behind
+    if (fo.index_node->type != REG || seek_arg->offset >= MAX_FILE_SIZE) {
         read_unlock(&fo.index_node->file_lock);
         return -EINVAL;
     }
@@ -1254,6 +3159,139 @@ static int rd_readdir(const pid_t pid, const rd_readdir_arg_t *usr_arg) {
     return 1;
 }
 
+/*
+ *  Makes node the home node of the open file or directory fd, whose new blocks,
+ *  and those of the files later created in the directory, come out of node's
+ *  pool. -1 goes back to the node of the writing cpu. Blocks already
+ *  allocated stay where they are.
+ */
+static int rd_setnode(const pid_t pid, const rd_setnode_arg_t *usr_arg) {
+    rd_setnode_arg_t setnode_arg;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    file_object_t fo;
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&setnode_arg, usr_arg, sizeof(rd_setnode_arg_t)) != 0)
+        return -EINVAL;
+    if (setnode_arg.node != NO_HOME_NODE &&
+        (setnode_arg.node < 0 || setnode_arg.node >= nr_node_ids || !node_online(setnode_arg.node)))
+        return -EINVAL;
+    fo = get_file_descriptor_table_entry(fdt, setnode_arg.fd);
+    if (fo.index_node == NULL)
+        return -EINVAL;
+    write_lock(&fo.index_node->file_lock);
+    fo.index_node->home_node = setnode_arg.node;
+    write_unlock(&fo.index_node->file_lock);
+    return 0;
+}
+
+/*
+ *  Maps zeroed blocks for length bytes of the open file fd at offset, in as
+ *  few contiguous runs as possible, so that later writes there don't have to
+ *  allocate. Unless mode has RD_FALLOC_KEEP_SIZE, a file ending before the
+ *  range grows to its end. A directory only takes RD_FALLOC_KEEP_SIZE, and
+ *  gets blocks from its EOF on so that its blocks stay contiguous.
+ */
+static int rd_fallocate(const pid_t pid, const rd_fallocate_arg_t *usr_arg) {
+    rd_fallocate_arg_t falloc_arg;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    file_object_t fo;
+    index_node_t *inode = NULL;
+    loff_t start = 0, end = 0;
+    int ret = 0;
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&falloc_arg, usr_arg, sizeof(rd_fallocate_arg_t)) != 0)
+        return -EINVAL;
+    if (falloc_arg.offset < 0 || falloc_arg.length <= 0 || (falloc_arg.mode & ~RD_FALLOC_KEEP_SIZE))
+        return -EINVAL;
+    if (falloc_arg.offset >= MAX_FILE_SIZE || falloc_arg.length > MAX_FILE_SIZE - falloc_arg.offset)
+        return -EFBIG;
+    fo = get_file_descriptor_table_entry(fdt, falloc_arg.fd);
+    if (fo.index_node == NULL)
+        return -EINVAL;
+    inode = fo.index_node;
+    start = falloc_arg.offset;
+    end = falloc_arg.offset + falloc_arg.length;
+    wait_for_reclaim(falloc_arg.length);
+    write_lock(&inode->file_lock);
+    if (inode->type == DIR && (falloc_arg.mode & RD_FALLOC_KEEP_SIZE)) {
+        start = inode->size;
+    } else if (inode->type != REG) {
+        write_unlock(&inode->file_lock);
+        return -EINVAL;
+    }
+    // an inline file has its first INLINE_DATA_SIZE bytes already
+    if (start < end && (!(inode->flags & INODE_INLINE) || end > INLINE_DATA_SIZE)) {
+        ret = promote_inline_data(inode);
+        if (ret == 0)
+            ret = preallocate_blocks(inode, start / BLOCK_SIZE, (end - 1) / BLOCK_SIZE);
+    }
+    if (ret == 0 && !(falloc_arg.mode & RD_FALLOC_KEEP_SIZE) && end > inode->size)
+        inode->size = end;
+    write_unlock(&inode->file_lock);
+    return ret;
+}
+
+/*
+ *  Sets the size of the regular file at pathname to length, keeping its inode
+ *  and directory entry. See truncate_inode.
+ */
+static int rd_truncate(const rd_truncate_arg_t *usr_arg) {
+    rd_truncate_arg_t truncate_arg;
+    char *pathname = NULL;
+    size_t usr_strlen = 0;
+    index_node_t *inode = NULL;
+    int ret = 0;
+    if (copy_from_user(&truncate_arg, usr_arg, sizeof(rd_truncate_arg_t)) != 0 || truncate_arg.length < 0)
+        return -EINVAL;
+    if (truncate_arg.length > MAX_FILE_SIZE)
+        return -EFBIG;
+    usr_strlen = strlen_user(truncate_arg.pathname);
+    if (usr_strlen == 0)
+        return -EINVAL;
+    pathname = kcalloc(usr_strlen, sizeof(char), GFP_KERNEL);
+    if (pathname == NULL)
+        return -1;
+    strncpy_from_user(pathname, truncate_arg.pathname, usr_strlen);
+    // growing an inline file moves its data to a block
+    wait_for_reclaim(BLOCK_SIZE);
+    inode = get_readlocked_index_node(pathname);
+    kfree(pathname);
+    if (inode == NULL)
+        return -EINVAL;
+    // the open count keeps rd_unlink away while the lock is dropped
+    atomic_inc(&inode->open_count);
+    read_unlock(&inode->file_lock);
+    write_lock(&inode->file_lock);
+    atomic_dec(&inode->open_count);
+    ret = truncate_inode(inode, truncate_arg.length);
+    write_unlock(&inode->file_lock);
+    return ret;
+}
+
+// Sets the size of the open regular file fd to length, see truncate_inode
+static int rd_ftruncate(const pid_t pid, const rd_ftruncate_arg_t *usr_arg) {
+    rd_ftruncate_arg_t truncate_arg;
+    file_descriptor_table_t *fdt = get_file_descriptor_table(pid);
+    file_object_t fo;
+    int ret = 0;
+    if (fdt == NULL)
+        return -1;
+    if (copy_from_user(&truncate_arg, usr_arg, sizeof(rd_ftruncate_arg_t)) != 0 || truncate_arg.length < 0)
+        return -EINVAL;
+    if (truncate_arg.length > MAX_FILE_SIZE)
+        return -EFBIG;
+    fo = get_file_descriptor_table_entry(fdt, truncate_arg.fd);
+    if (fo.index_node == NULL)
+        return -EINVAL;
+    wait_for_reclaim(BLOCK_SIZE);
+    write_lock(&fo.index_node->file_lock);
+    ret = truncate_inode(fo.index_node, truncate_arg.length);
+    write_unlock(&fo.index_node->file_lock);
+    return ret;
+}
+
 module_init(initialization_routine);
 module_exit(cleanup_routine);
 
@@ -6,11 +6,49 @@ typedef struct rd_rwfile_arg {
     int num_bytes;
 } rd_rwfile_arg_t;
 
+typedef struct rd_prwfile_arg {
+    char *address;
+    int fd;
+    int num_bytes;
+    long long offset;
+} rd_prwfile_arg_t;
+
+typedef struct rd_rwvec_arg {
+    const struct iovec *iov;    // at most 1024 segments, filled or drained in order
+    int fd;
+    int iovcnt;
+} rd_rwvec_arg_t;
+
 typedef struct rd_seek_arg {
     int fd;
-    int offset;
+    long long offset;
 } rd_seek_arg_t;
 
+typedef struct rd_setnode_arg {
+    int fd;
+    int node;   // NUMA node, or -1 for the node of the writing cpu
+} rd_setnode_arg_t;
+
+typedef struct rd_fallocate_arg {
+    int fd;
+    int mode;   // 0 or RD_FALLOC_KEEP_SIZE
+    long long offset;
+    long long length;
+} rd_fallocate_arg_t;
+
+// rd_fallocate_arg_t.mode
+#define RD_FALLOC_KEEP_SIZE 0x1     // map the range without growing the file
+
+typedef struct rd_truncate_arg {
+    char *pathname;
+    long long length;
+} rd_truncate_arg_t;
+
+typedef struct rd_ftruncate_arg {
+    int fd;
+    long long length;
+} rd_ftruncate_arg_t;
+
 typedef struct rd_readdir_arg {
     char *address;
     int fd;
@@ -27,4 +65,12 @@ typedef struct rd_readdir_arg {
 #define RD_WRITE _IOW(MAJOR_NUM, 6, struct rd_rwfile_arg)
 #define RD_LSEEK _IOW(MAJOR_NUM, 7, struct rd_seek_arg)
 #define RD_UNLINK _IOW(MAJOR_NUM, 8, char *)
-#define RD_READDIR _IOWR(MAJOR_NUM, 9, char *)
\ No newline at end of file
+#define RD_READDIR _IOWR(MAJOR_NUM, 9, char *)
+#define RD_SETNODE _IOW(MAJOR_NUM, 10, struct rd_setnode_arg)
+#define RD_FALLOCATE _IOW(MAJOR_NUM, 11, struct rd_fallocate_arg)
+#define RD_TRUNCATE _IOW(MAJOR_NUM, 12, struct rd_truncate_arg)
+#define RD_FTRUNCATE _IOW(MAJOR_NUM, 13, struct rd_ftruncate_arg)
+#define RD_PREAD _IOWR(MAJOR_NUM, 14, struct rd_prwfile_arg)
+#define RD_PWRITE _IOW(MAJOR_NUM, 15, struct rd_prwfile_arg)
+#define RD_READV _IOWR(MAJOR_NUM, 16, struct rd_rwvec_arg)
+#define RD_WRITEV _IOW(MAJOR_NUM, 17, struct rd_rwvec_arg)
\ No newline at end of file
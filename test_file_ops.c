@@ -0,0 +1,643 @@
+/*
+   -- tests for the RAMDISK file operations beyond the assignment's set.
+   -- include a case for:
+   -- seeking past EOF, writing, and reading the hole back as zeros
+   -- preallocating with and without RD_FALLOC_KEEP_SIZE
+   -- truncating down, up and to 0, under another descriptor's feet
+   -- positioned reads and writes, which leave the file position alone
+   -- scatter-gather reads and writes, with empty and bad segments
+   -- block accounting: free_blocks in /proc/ramdisk_stats before and
+   after each operation, and back where it started once the files are
+   unlinked and the reclaim worker has caught up
+   -- error checking on invalid inputs
+   -- extent trees: run it once more after loading the module with
+   rd_extents=1, which adds TEST6 on files fragmented past the extents
+   the inode holds
+   -- expects a freshly loaded module with the default parameters (but
+   rd_extents) and 256 byte blocks, so that block counts are exact
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "ramdisk.h"
+#include "ramdisk_module.h"
+
+// #define's to control what tests are performed,
+// comment out a test if you do not wish to perform it
+
+#define TEST1
+#define TEST2
+#define TEST3
+#define TEST4
+#define TEST5
+#define TEST6
+
+#define BLK_SZ 256		/* Block size */
+#define DIRECT 8		/* Direct pointers in location attribute */
+#define MAP_BLKS 4		/* Most indirect blocks one write can add to the map */
+#define PTRS_PB  (BLK_SZ / 4)	/* Pointers per index block */
+#define MAX_FILE_SZ ((long long) (DIRECT + PTRS_PB + PTRS_PB * PTRS_PB + PTRS_PB * PTRS_PB * PTRS_PB \
+				  + PTRS_PB * PTRS_PB * PTRS_PB * PTRS_PB) * BLK_SZ)
+#define ROOT_EXTS 5		/* Extents held by the inode */
+#define EXTS_PB ((BLK_SZ - 4) / 12)	/* Extents per extent tree block */
+#define EXT_BLKS (2 * ROOT_EXTS * EXTS_PB)	/* Blocks per file in TEST6, a leaf more than a one level tree holds */
+
+static char data1[DIRECT*BLK_SZ];	/* Some file data */
+static char data2[16];			/* Some other file data */
+static struct iovec iov[UIO_MAXIOV + 1];	/* Segments for readv and writev */
+static char addr[DIRECT*BLK_SZ*4];	/* Scratchpad memory */
+
+/* Returns the value of the name line of the ramdisk statistics, or -1 if it can't be read */
+static long read_stat (const char *name) {
+  char line[128];
+  long value = -1;
+  size_t len = strlen (name);
+  FILE *stats = fopen ("/proc/ramdisk_stats", "r");
+
+  if (stats == NULL)
+    return -1;
+  while (fgets (line, sizeof (line), stats) != NULL)
+    if (strncmp (line, name, len) == 0 && line[len] == ' ')
+      value = atol (line + len + 1);
+  fclose (stats);
+  return value;
+}
+
+/* Returns free_blocks once no unlinked file waits for reclaim and the count holds still */
+static long free_blocks (void) {
+  long before = -1, now = read_stat ("free_blocks");
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    if (read_stat ("pending_reclaim_blocks") == 0 && now == before)
+      return now;
+    usleep (10000);
+    before = now;
+    now = read_stat ("free_blocks");
+  }
+  return now;
+}
+
+/* Returns 1 if the module was loaded with rd_extents=1 */
+static int extents_enabled (void) {
+  char value = 'N';
+  FILE *param = fopen ("/sys/module/ramdisk_module/parameters/rd_extents", "r");
+
+  if (param == NULL)
+    return 0;
+  if (fscanf (param, " %c", &value) != 1)
+    value = 'N';
+  fclose (param);
+  return value == 'Y' || value == '1';
+}
+
+/* Returns 1 if len bytes at buf are all c */
+static int all_bytes (const char *buf, int len, char c) {
+  int i;
+
+  for (i = 0; i < len; i++)
+    if (buf[i] != c)
+      return 0;
+  return 1;
+}
+
+/* Creates and opens pathname, exiting on failure */
+static int creat_open (char *pathname) {
+  int retval;
+
+  retval = rd_creat (pathname);
+  if (retval < 0) {
+    fprintf (stderr, "creat: %s creation error! status: %d\n", pathname, retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_open (pathname);
+  if (retval < 0) {
+    fprintf (stderr, "open: %s open error! status: %d\n", pathname, retval);
+    exit(EXIT_FAILURE);
+  }
+  return retval;
+}
+
+/* Returns the size of the file open as fd, as far as reading from 0 tells */
+static int file_size (int fd) {
+  return rd_pread (fd, addr, sizeof (addr), 0);
+}
+
+/* Closes fd and unlinks pathname, then checks that free_blocks is back at start */
+static void close_unlink (int fd, char *pathname, long start) {
+  long now;
+
+  if (rd_close (fd) < 0 || rd_unlink (pathname) < 0) {
+    fprintf (stderr, "unlink: %s deletion error!\n", pathname);
+    exit(EXIT_FAILURE);
+  }
+  now = free_blocks ();
+  if (now != start) {
+    fprintf (stderr, "unlink: %s leaked blocks! free_blocks %ld, expected %ld\n", pathname, now, start);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main () {
+
+  int retval, fd, fd2, fd3, i, extents;
+  long start, before, now;
+
+  /* Some arbitrary data for our files */
+  memset (data1, '1', sizeof (data1));
+  memset (data2, '2', sizeof (data2));
+
+  if (read_stat ("free_blocks") < 0) {
+    /* The statistics only show up once the ramdisk is initialized */
+    rd_creat ("/init");
+    rd_unlink ("/init");
+  }
+  extents = extents_enabled ();
+
+
+#ifdef TEST1
+
+  /* ****TEST 1: Write past EOF and read the hole back**** */
+  start = free_blocks ();
+  fd = creat_open ("/sparse");
+
+  /* Leave a hole of DIRECT + 2 blocks and a bit */
+  retval = rd_lseek (fd, (DIRECT + 2) * BLK_SZ + 10);
+  if (retval < 0) {
+    fprintf (stderr, "lseek: File seek past EOF error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  before = free_blocks ();
+  retval = rd_write (fd, data1, 100);
+  if (retval != 100) {
+    fprintf (stderr, "write: File write past EOF error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  /* Only the block written to and its map are allocated, not the hole */
+  now = free_blocks ();
+  if (before - now < 1 || before - now > 1 + MAP_BLKS) {
+    fprintf (stderr, "write: Writing past a hole took %ld blocks!\n", before - now);
+    exit(EXIT_FAILURE);
+  }
+
+  rd_lseek (fd, 0);
+  memset (addr, 'x', sizeof (addr));
+  retval = rd_read (fd, addr, sizeof (addr));
+  if (retval != (DIRECT + 2) * BLK_SZ + 110) {
+    fprintf (stderr, "read: Sparse file read error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  if (!all_bytes (addr, (DIRECT + 2) * BLK_SZ + 10, 0) || !all_bytes (addr + (DIRECT + 2) * BLK_SZ + 10, 100, '1')) {
+    fprintf (stderr, "read: Hole doesn't read back as zeros!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Filling in part of the hole allocates just that block */
+  before = free_blocks ();
+  rd_lseek (fd, BLK_SZ);
+  retval = rd_write (fd, data1, BLK_SZ);
+  now = free_blocks ();
+  if (retval != BLK_SZ || before - now != 1) {
+    fprintf (stderr, "write: Filling a hole block took %ld blocks! status: %d\n", before - now, retval);
+    exit(EXIT_FAILURE);
+  }
+
+  close_unlink (fd, "/sparse", start);
+
+#endif // TEST1
+
+#ifdef TEST2
+
+  /* ****TEST 2: Preallocation**** */
+  start = free_blocks ();
+  fd = creat_open ("/falloc");
+
+  /* Mode 0 maps the blocks and grows the file, which reads as zeros */
+  before = free_blocks ();
+  retval = rd_fallocate (fd, 0, 0, 4 * BLK_SZ);
+  now = free_blocks ();
+  if (retval < 0 || before - now != 4 || file_size (fd) != 4 * BLK_SZ || !all_bytes (addr, 4 * BLK_SZ, 0)) {
+    fprintf (stderr, "fallocate: Mode 0 error! status: %d, %ld blocks\n", retval, before - now);
+    exit(EXIT_FAILURE);
+  }
+
+  /* RD_FALLOC_KEEP_SIZE maps the blocks past EOF but leaves the size alone */
+  before = now;
+  retval = rd_fallocate (fd, RD_FALLOC_KEEP_SIZE, 4 * BLK_SZ, 4 * BLK_SZ);
+  now = free_blocks ();
+  if (retval < 0 || before - now != 4 || file_size (fd) != 4 * BLK_SZ) {
+    fprintf (stderr, "fallocate: KEEP_SIZE error! status: %d, %ld blocks\n", retval, before - now);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Writing into the reserved range allocates nothing */
+  before = now;
+  rd_lseek (fd, 4 * BLK_SZ);
+  retval = rd_write (fd, data1, 4 * BLK_SZ);
+  now = free_blocks ();
+  if (retval != 4 * BLK_SZ || before != now || file_size (fd) != DIRECT * BLK_SZ) {
+    fprintf (stderr, "write: Write into preallocated blocks took %ld blocks! status: %d\n", before - now, retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Ranges past the largest file are refused */
+  retval = rd_fallocate (fd, 0, MAX_FILE_SZ - BLK_SZ, 2 * BLK_SZ);
+  if (retval >= 0 || errno != EFBIG) {
+    fprintf (stderr, "fallocate: Range past the largest file didn't fail with EFBIG! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  close_unlink (fd, "/falloc", start);
+
+  /* A size 0 file holding preallocated blocks gives them all back */
+  fd = creat_open ("/falloc");
+  retval = rd_fallocate (fd, RD_FALLOC_KEEP_SIZE, 0, (DIRECT + 2) * BLK_SZ);
+  if (retval < 0 || file_size (fd) != 0) {
+    fprintf (stderr, "fallocate: KEEP_SIZE on an empty file error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  close_unlink (fd, "/falloc", start);
+
+  /* More blocks than are free fails with ENOSPC, and whatever got mapped is released with the file */
+  if ((free_blocks () + 1) * BLK_SZ < MAX_FILE_SZ) {
+    fd = creat_open ("/falloc");
+    retval = rd_fallocate (fd, RD_FALLOC_KEEP_SIZE, 0, (free_blocks () + 1) * BLK_SZ);
+    if (retval >= 0 || errno != ENOSPC) {
+      fprintf (stderr, "fallocate: Preallocating the whole ramdisk didn't fail with ENOSPC! status: %d\n", retval);
+      exit(EXIT_FAILURE);
+    }
+    close_unlink (fd, "/falloc", start);
+  }
+
+  /* A directory can only reserve blocks for entries, not grow */
+  retval = rd_mkdir ("/fdir");
+  if (retval < 0) {
+    fprintf (stderr, "mkdir: Directory creation error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  fd = rd_open ("/fdir");
+  retval = rd_fallocate (fd, 0, 0, BLK_SZ);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "fallocate: Growing a directory didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_fallocate (fd, RD_FALLOC_KEEP_SIZE, 0, 2 * BLK_SZ);
+  if (retval < 0) {
+    fprintf (stderr, "fallocate: Directory KEEP_SIZE error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  close_unlink (fd, "/fdir", start);
+
+#endif // TEST2
+
+#ifdef TEST3
+
+  /* ****TEST 3: Truncation**** */
+  start = free_blocks ();
+  fd = creat_open ("/trunc");
+
+  /* DIRECT blocks plus DIRECT more behind a single indirect block */
+  if (rd_write (fd, data1, sizeof (data1)) != sizeof (data1) || rd_write (fd, data1, sizeof (data1)) != sizeof (data1)) {
+    fprintf (stderr, "write: File write error!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* A second descriptor with a cursor cached in the indirect block */
+  fd2 = rd_open ("/trunc");
+  rd_lseek (fd2, (DIRECT + 4) * BLK_SZ);
+  retval = rd_read (fd2, addr, BLK_SZ);
+  if (retval != BLK_SZ || !all_bytes (addr, BLK_SZ, '1')) {
+    fprintf (stderr, "read: File read error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Shrinking to 3 blocks and a bit releases the other data blocks and the indirect block,
+     which an extent file this short doesn't have */
+  before = free_blocks ();
+  retval = rd_ftruncate (fd, 3 * BLK_SZ + 10);
+  now = free_blocks ();
+  if (retval < 0 || now - before != 2 * DIRECT - 4 + !extents || file_size (fd) != 3 * BLK_SZ + 10) {
+    fprintf (stderr, "ftruncate: Shrink error! status: %d, %ld blocks released\n", retval, now - before);
+    exit(EXIT_FAILURE);
+  }
+
+  /* The released blocks go to another file, with other data; its directory entry may take a block of its own */
+  memset (addr, '2', sizeof (data1));
+  fd3 = creat_open ("/trunc2");
+  rd_write (fd3, addr, sizeof (data1));
+
+  /* Growing leaves a hole, which takes no blocks and reads as zeros */
+  before = free_blocks ();
+  retval = rd_ftruncate (fd, (DIRECT + 6) * BLK_SZ);
+  now = free_blocks ();
+  if (retval < 0 || before != now || file_size (fd) != (DIRECT + 6) * BLK_SZ ||
+      !all_bytes (addr, 3 * BLK_SZ + 10, '1') || !all_bytes (addr + 3 * BLK_SZ + 10, (DIRECT + 3) * BLK_SZ - 10, 0)) {
+    fprintf (stderr, "ftruncate: Grow error! status: %d, %ld blocks taken\n", retval, before - now);
+    exit(EXIT_FAILURE);
+  }
+
+  /* The second descriptor carries on past its stale cursor and must see the hole, not the other file */
+  memset (addr, 'x', BLK_SZ);
+  retval = rd_read (fd2, addr, BLK_SZ);
+  if (retval != BLK_SZ || !all_bytes (addr, BLK_SZ, 0)) {
+    fprintf (stderr, "read: Read through a cursor cached before truncation returned stale data! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  rd_close (fd2);
+  rd_close (fd3);
+  rd_unlink ("/trunc2");
+
+  /* Truncating to 0 by name releases the 4 blocks left, and the file is stored inline again */
+  before = free_blocks ();
+  retval = rd_truncate ("/trunc", 0);
+  now = free_blocks ();
+  if (retval < 0 || now - before != 4 || file_size (fd) != 0) {
+    fprintf (stderr, "truncate: Truncate to 0 error! status: %d, %ld blocks released\n", retval, now - before);
+    exit(EXIT_FAILURE);
+  }
+  rd_lseek (fd, 0);
+  retval = rd_write (fd, data1, 10);
+  if (retval != 10 || free_blocks () != now) {
+    fprintf (stderr, "write: Small write after truncate to 0 took a block! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Invalid lengths */
+  retval = rd_ftruncate (fd, -1);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "ftruncate: Negative length didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_truncate ("/trunc", MAX_FILE_SZ + 1);
+  if (retval >= 0 || errno != EFBIG) {
+    fprintf (stderr, "truncate: Length past the largest file didn't fail with EFBIG! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  close_unlink (fd, "/trunc", start);
+
+#endif // TEST3
+
+#ifdef TEST4
+
+  /* ****TEST 4: Positioned reads and writes**** */
+  start = free_blocks ();
+  fd = creat_open ("/prw");
+  rd_write (fd, data1, sizeof (data1));
+  rd_lseek (fd, 1000);
+
+  /* pwrite puts its bytes at the offset given... */
+  retval = rd_pwrite (fd, data2, 10, 1005);
+  if (retval != 10) {
+    fprintf (stderr, "pwrite: File pwrite error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_pread (fd, addr, 20, 1000);
+  if (retval != 20 || !all_bytes (addr, 5, '1') || !all_bytes (addr + 5, 10, '2') || !all_bytes (addr + 15, 5, '1')) {
+    fprintf (stderr, "pread: File pread error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  /* ...and neither call moves the file position */
+  retval = rd_read (fd, addr, 10);
+  if (retval != 10 || !all_bytes (addr, 5, '1') || !all_bytes (addr + 5, 5, '2')) {
+    fprintf (stderr, "pread: File position moved by pread or pwrite!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Reads at or past EOF return 0 */
+  retval = rd_pread (fd, addr, 10, sizeof (data1));
+  if (retval != 0 || rd_pread (fd, addr, 10, 2 * sizeof (data1)) != 0) {
+    fprintf (stderr, "pread: Read past EOF returned data! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* pwrite past EOF extends the file, leaving a hole, and still doesn't move the position */
+  retval = rd_pwrite (fd, data2, 10, 3000);
+  if (retval != 10 || file_size (fd) != 3010 || !all_bytes (addr + sizeof (data1), 3000 - sizeof (data1), 0) ||
+      !all_bytes (addr + 3000, 10, '2')) {
+    fprintf (stderr, "pwrite: Extending pwrite error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_read (fd, addr, 10);
+  if (retval != 10 || !all_bytes (addr, 5, '2') || !all_bytes (addr + 5, 5, '1')) {
+    fprintf (stderr, "pwrite: File position moved by an extending pwrite!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Invalid offsets */
+  retval = rd_pread (fd, addr, 10, -1);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "pread: Negative offset didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_pwrite (fd, data2, 10, MAX_FILE_SZ);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "pwrite: Offset past the largest file didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  close_unlink (fd, "/prw", start);
+
+#endif // TEST4
+
+#ifdef TEST5
+
+  /* ****TEST 5: Scatter-gather reads and writes**** */
+  start = free_blocks ();
+  fd = creat_open ("/vec");
+
+  /* Three segments, one of them empty, gathered in order */
+  iov[0].iov_base = data1;
+  iov[0].iov_len = 300;
+  iov[1].iov_base = data2;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = data2;
+  iov[2].iov_len = sizeof (data2);
+  retval = rd_writev (fd, iov, 3);
+  if (retval != 300 + sizeof (data2) || file_size (fd) != 300 + sizeof (data2) ||
+      !all_bytes (addr, 300, '1') || !all_bytes (addr + 300, sizeof (data2), '2')) {
+    fprintf (stderr, "writev: File writev error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Scattered back over differently cut segments, the empty one skipped */
+  memset (addr, 'x', sizeof (addr));
+  iov[0].iov_base = addr;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = addr + 1000;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = addr + 100;
+  iov[2].iov_len = 210;
+  iov[3].iov_base = addr + 310;
+  iov[3].iov_len = 6;
+  rd_lseek (fd, 0);
+  retval = rd_readv (fd, iov, 4);
+  if (retval != 300 + sizeof (data2) || !all_bytes (addr, 300, '1') || !all_bytes (addr + 300, sizeof (data2), '2') ||
+      addr[1000] != 'x') {
+    fprintf (stderr, "readv: File readv error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* A vector straddling EOF fills up to EOF, leaving the rest of the segments alone */
+  memset (addr, 'x', sizeof (addr));
+  iov[0].iov_base = addr;
+  iov[0].iov_len = 10;
+  iov[1].iov_base = addr + 10;
+  iov[1].iov_len = 100;
+  rd_lseek (fd, 300);
+  retval = rd_readv (fd, iov, 2);
+  if (retval != sizeof (data2) || !all_bytes (addr, sizeof (data2), '2') || addr[sizeof (data2)] != 'x') {
+    fprintf (stderr, "readv: Read across EOF error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_readv (fd, iov, 2);
+  if (retval != 0) {
+    fprintf (stderr, "readv: Read at EOF returned data! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* A bad segment stops the read after the bytes that made it, and the position only moves by those */
+  iov[0].iov_base = addr;
+  iov[0].iov_len = 10;
+  iov[1].iov_base = NULL;
+  iov[1].iov_len = 10;
+  rd_lseek (fd, 295);
+  retval = rd_readv (fd, iov, 2);
+  if (retval != 10 || rd_read (fd, addr, 100) != sizeof (data2) - 5) {
+    fprintf (stderr, "readv: Read into a bad segment error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  rd_lseek (fd, 0);
+  retval = rd_readv (fd, iov + 1, 1);
+  if (retval >= 0 || errno != EFAULT) {
+    fprintf (stderr, "readv: Read into a bad segment alone didn't fail with EFAULT! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  /* More than UIO_MAXIOV segments are refused */
+  for (i = 0; i <= UIO_MAXIOV; i++) {
+    iov[i].iov_base = data2;
+    iov[i].iov_len = 1;
+  }
+  retval = rd_writev (fd, iov, UIO_MAXIOV + 1);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "writev: Too many segments didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  retval = rd_readv (fd, iov, UIO_MAXIOV + 1);
+  if (retval >= 0 || errno != EINVAL) {
+    fprintf (stderr, "readv: Too many segments didn't fail with EINVAL! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+  /* while exactly UIO_MAXIOV are fine */
+  rd_lseek (fd, 0);
+  retval = rd_writev (fd, iov, UIO_MAXIOV);
+  if (retval != UIO_MAXIOV) {
+    fprintf (stderr, "writev: UIO_MAXIOV segments error! status: %d\n", retval);
+    exit(EXIT_FAILURE);
+  }
+
+  close_unlink (fd, "/vec", start);
+
+#endif // TEST5
+
+#ifdef TEST6
+
+  /* ****TEST 6: Extent trees, with rd_extents=1 only**** */
+  if (extents) {
+    start = free_blocks ();
+    fd = creat_open ("/ext1");
+    fd2 = creat_open ("/ext2");
+
+    /* Appending to two files in turn leaves every block of each an extent of its own,
+       so the root splits into a tree and the tree grows a level */
+    for (i = 0; i < EXT_BLKS; i++) {
+      memset (addr, 'a' + i % 26, BLK_SZ);
+      if (rd_write (fd, addr, BLK_SZ) != BLK_SZ || rd_write (fd2, data1, BLK_SZ) != BLK_SZ) {
+        fprintf (stderr, "write: Interleaved append error at block %d!\n", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+    now = free_blocks ();
+    if (start - now <= 2 * EXT_BLKS) {
+      fprintf (stderr, "write: Fragmented files took no extent tree blocks! %ld blocks\n", start - now);
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < EXT_BLKS; i++) {
+      retval = rd_pread (fd, addr, BLK_SZ, (long long) i * BLK_SZ);
+      if (retval != BLK_SZ || !all_bytes (addr, BLK_SZ, 'a' + i % 26)) {
+        fprintf (stderr, "pread: Fragmented file read error at block %d! status: %d\n", i, retval);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    /* Shrinking to half and a bit releases the data blocks past it and the leaves left empty */
+    before = free_blocks ();
+    retval = rd_ftruncate (fd, EXT_BLKS / 2 * BLK_SZ + 10);
+    now = free_blocks ();
+    if (retval < 0 || now - before < EXT_BLKS / 2 - 1) {
+      fprintf (stderr, "ftruncate: Extent tree shrink error! status: %d, %ld blocks released\n", retval, now - before);
+      exit(EXIT_FAILURE);
+    }
+
+    /* Growing back leaves a hole, which takes no blocks */
+    before = now;
+    retval = rd_ftruncate (fd, EXT_BLKS * BLK_SZ);
+    now = free_blocks ();
+    if (retval < 0 || before != now) {
+      fprintf (stderr, "ftruncate: Extent tree grow error! status: %d, %ld blocks taken\n", retval, before - now);
+      exit(EXIT_FAILURE);
+    }
+
+    /* Filling every other hole block from the end down inserts each extent in front of the last one */
+    for (i = EXT_BLKS - 1; i > EXT_BLKS / 2; i -= 2) {
+      memset (addr, 'a' + i % 26, BLK_SZ);
+      retval = rd_pwrite (fd, addr, BLK_SZ, (long long) i * BLK_SZ);
+      if (retval != BLK_SZ) {
+        fprintf (stderr, "pwrite: Write into an extent tree hole error at block %d! status: %d\n", i, retval);
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (free_blocks () >= now) {
+      fprintf (stderr, "pwrite: Filling holes took no blocks!\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < EXT_BLKS; i++) {
+      memset (addr, 'x', BLK_SZ);
+      retval = rd_pread (fd, addr, BLK_SZ, (long long) i * BLK_SZ);
+      if (retval != BLK_SZ ||
+          (i < EXT_BLKS / 2 && !all_bytes (addr, BLK_SZ, 'a' + i % 26)) ||
+          (i == EXT_BLKS / 2 && (!all_bytes (addr, 10, 'a' + i % 26) || !all_bytes (addr + 10, BLK_SZ - 10, 0))) ||
+          (i > EXT_BLKS / 2 && !all_bytes (addr, BLK_SZ, (EXT_BLKS - 1 - i) % 2 == 0 ? 'a' + i % 26 : 0))) {
+        fprintf (stderr, "pread: Extent tree with holes read error at block %d! status: %d\n", i, retval);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    /* Truncating the other file to 0 by name releases its data blocks and its whole tree */
+    before = free_blocks ();
+    retval = rd_truncate ("/ext2", 0);
+    now = free_blocks ();
+    if (retval < 0 || now - before <= EXT_BLKS || file_size (fd2) != 0) {
+      fprintf (stderr, "truncate: Extent tree truncate to 0 error! status: %d, %ld blocks released\n", retval, now - before);
+      exit(EXIT_FAILURE);
+    }
+    if (rd_close (fd2) < 0 || rd_unlink ("/ext2") < 0) {
+      fprintf (stderr, "unlink: /ext2 deletion error!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* Unlinking a file that still has its tree hands it all to the reclaim worker */
+    close_unlink (fd, "/ext1", start);
+  }
+
+#endif // TEST6
+
+  printf("Congratulations, you have passed all tests!!\n");
+
+  return 0;
+}